@@ -0,0 +1,98 @@
+#include "acpi.h"
+#include "string.h"
+#include "log.h"
+#include <stddef.h>
+
+// RSDP is in the first KiB of EBDA, or in BIOS ROM, on 16 bytes boundary
+#define ACPI_EBDA_SEGMENT 0x40E
+#define ACPI_BIOS_BEGIN   0xE0000
+#define ACPI_BIOS_END     0x100000
+
+static bool acpi_checksum(const void* data, uint32_t length) {
+	const uint8_t* bytes = data;
+	uint8_t sum = 0;
+	for (uint32_t i = 0; i != length; ++i) {
+		sum += bytes[i];
+	}
+	return sum == 0;
+}
+
+static struct acpi_rsdp* acpi_find_rsdp_in(phys_t begin, phys_t end) {
+	for (phys_t pos = begin; pos + sizeof(struct acpi_rsdp) <= end; pos += 16) {
+		struct acpi_rsdp* rsdp = va(pos);
+		if (strncmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum(rsdp, 20)) {
+			return rsdp;
+		}
+	}
+	return NULL;
+}
+
+static struct acpi_rsdp* acpi_find_rsdp(void) {
+	phys_t ebda = (phys_t)*(uint16_t*)va(ACPI_EBDA_SEGMENT) << 4;
+	struct acpi_rsdp* rsdp = NULL;
+	if (ebda != 0) {
+		rsdp = acpi_find_rsdp_in(ebda, ebda + 1024);
+	}
+	return rsdp ?: acpi_find_rsdp_in(ACPI_BIOS_BEGIN, ACPI_BIOS_END);
+}
+
+// Through XSDT if there is one, RSDT otherwise
+static struct acpi_header* acpi_find_table(struct acpi_rsdp* rsdp, const char* signature) {
+	bool is_xsdt = rsdp->revision >= 2 && rsdp->xsdt != 0;
+	struct acpi_header* root = va(is_xsdt ? rsdp->xsdt : rsdp->rsdt);
+	if (!acpi_checksum(root, root->length)) {
+		log(LEVEL_WARN, "ACPI root table is broken.");
+		return NULL;
+	}
+	int entry_size = is_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+	int count = (root->length - sizeof(*root)) / entry_size;
+	uint8_t* entries = (uint8_t*)(root + 1);
+	for (int i = 0; i != count; ++i) {
+		phys_t table_phys = is_xsdt ? *(uint64_t*)(entries + i * entry_size) : *(uint32_t*)(entries + i * entry_size);
+		struct acpi_header* table = va(table_phys);
+		if (strncmp(table->signature, signature, 4) == 0 && acpi_checksum(table, table->length)) {
+			return table;
+		}
+	}
+	return NULL;
+}
+
+bool acpi_read_cpus(struct acpi_cpus* cpus) {
+	struct acpi_rsdp* rsdp = acpi_find_rsdp();
+	if (rsdp == NULL) {
+		log(LEVEL_WARN, "No ACPI RSDP found.");
+		return false;
+	}
+	struct acpi_madt* madt = (struct acpi_madt*)acpi_find_table(rsdp, "APIC");
+	if (madt == NULL) {
+		log(LEVEL_WARN, "No ACPI MADT found.");
+		return false;
+	}
+
+	cpus->lapic_base = madt->lapic_base;
+	cpus->count = 0;
+	uint8_t* pos = (uint8_t*)(madt + 1);
+	uint8_t* end = (uint8_t*)madt + madt->header.length;
+	while (pos + sizeof(struct acpi_madt_entry) <= end) {
+		struct acpi_madt_entry* entry = (struct acpi_madt_entry*)pos;
+		if (entry->length < sizeof(*entry)) {
+			log(LEVEL_WARN, "MADT entry of length %d, stopping.", entry->length);
+			break;
+		}
+		if (entry->type == ACPI_MADT_LAPIC) {
+			struct acpi_madt_lapic* lapic = (struct acpi_madt_lapic*)entry;
+			if ((lapic->flags & ACPI_MADT_LAPIC_ENABLED) == 0) {
+				log(LEVEL_V, "CPU with APIC ID %d is disabled.", lapic->apic_id);
+			} else if (cpus->count == CPU_MAX) {
+				log(LEVEL_WARN, "CPU with APIC ID %d is over %d, ignored.", lapic->apic_id, CPU_MAX);
+			} else {
+				cpus->apic_ids[cpus->count++] = lapic->apic_id;
+			}
+		} else if (entry->type == ACPI_MADT_LAPIC_OVERRIDE) {
+			cpus->lapic_base = ((struct acpi_madt_lapic_override*)entry)->base;
+		}
+		pos += entry->length;
+	}
+	log(LEVEL_INFO, "MADT: %d CPUs, LAPIC at %p.", cpus->count, cpus->lapic_base);
+	return true;
+}
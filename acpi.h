@@ -0,0 +1,71 @@
+#pragma once
+
+#include "memory.h"
+#include "cpu.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+struct acpi_rsdp {
+	char signature[8];
+	uint8_t checksum;
+	char oem[6];
+	uint8_t revision;
+	uint32_t rsdt;
+	// Since revision 2
+	uint32_t length;
+	uint64_t xsdt;
+	uint8_t ext_checksum;
+	uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem[6];
+	char oem_table[8];
+	uint32_t oem_revision;
+	uint32_t creator;
+	uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+	struct acpi_header header;
+	uint32_t lapic_base;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_entry {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed));
+
+#define ACPI_MADT_LAPIC          0
+#define ACPI_MADT_LAPIC_OVERRIDE 5
+
+// Others may be hot-plugged later, not started now
+#define ACPI_MADT_LAPIC_ENABLED (1 << 0)
+
+struct acpi_madt_lapic {
+	struct acpi_madt_entry entry;
+	uint8_t processor;
+	uint8_t apic_id;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_lapic_override {
+	struct acpi_madt_entry entry;
+	uint16_t reserved;
+	uint64_t base;
+} __attribute__((packed));
+
+// What SMP needs from MADT
+struct acpi_cpus {
+	phys_t lapic_base;
+	int count;
+	uint32_t apic_ids[CPU_MAX];
+};
+
+// False if there is no ACPI or MADT. Usable CPUs over CPU_MAX are ignored.
+bool acpi_read_cpus(struct acpi_cpus* cpus);
@@ -0,0 +1,157 @@
+#include "avl.h"
+
+void avl_init(struct avl_tree* tree, avl_less_t less) {
+	tree->root = NULL;
+	tree->first = NULL;
+	tree->less = less;
+}
+
+bool avl_empty(struct avl_tree* tree) {
+	return tree->root == NULL;
+}
+
+struct avl_node* avl_first(struct avl_tree* tree) {
+	return tree->first;
+}
+
+static struct avl_node* avl_leftmost(struct avl_node* node) {
+	while (node->left != NULL) {
+		node = node->left;
+	}
+	return node;
+}
+
+struct avl_node* avl_next(struct avl_node* node) {
+	if (node->right != NULL) {
+		return avl_leftmost(node->right);
+	}
+	while (node->parent != NULL && node->parent->right == node) {
+		node = node->parent;
+	}
+	return node->parent;
+}
+
+static inline int avl_height(struct avl_node* node) {
+	return node != NULL ? node->height : 0;
+}
+
+static void avl_update(struct avl_node* node) {
+	int left = avl_height(node->left);
+	int right = avl_height(node->right);
+	node->height = (left > right ? left : right) + 1;
+}
+
+static void avl_replace_child(struct avl_tree* tree, struct avl_node* parent, struct avl_node* old, struct avl_node* new) {
+	if (parent == NULL) {
+		tree->root = new;
+	} else if (parent->left == old) {
+		parent->left = new;
+	} else {
+		parent->right = new;
+	}
+	if (new != NULL) {
+		new->parent = parent;
+	}
+}
+
+static struct avl_node* avl_rotate_left(struct avl_tree* tree, struct avl_node* node) {
+	struct avl_node* right = node->right;
+	node->right = right->left;
+	if (right->left != NULL) {
+		right->left->parent = node;
+	}
+	avl_replace_child(tree, node->parent, node, right);
+	right->left = node;
+	node->parent = right;
+	avl_update(node);
+	avl_update(right);
+	return right;
+}
+
+static struct avl_node* avl_rotate_right(struct avl_tree* tree, struct avl_node* node) {
+	struct avl_node* left = node->left;
+	node->left = left->right;
+	if (left->right != NULL) {
+		left->right->parent = node;
+	}
+	avl_replace_child(tree, node->parent, node, left);
+	left->right = node;
+	node->parent = left;
+	avl_update(node);
+	avl_update(left);
+	return left;
+}
+
+// Fix heights & balance from node up to the root
+static void avl_rebalance(struct avl_tree* tree, struct avl_node* node) {
+	while (node != NULL) {
+		avl_update(node);
+		int balance = avl_height(node->left) - avl_height(node->right);
+		if (balance > 1) {
+			if (avl_height(node->left->left) < avl_height(node->left->right)) {
+				avl_rotate_left(tree, node->left);
+			}
+			node = avl_rotate_right(tree, node);
+		} else if (balance < -1) {
+			if (avl_height(node->right->right) < avl_height(node->right->left)) {
+				avl_rotate_right(tree, node->right);
+			}
+			node = avl_rotate_left(tree, node);
+		}
+		node = node->parent;
+	}
+}
+
+void avl_insert(struct avl_tree* tree, struct avl_node* node) {
+	node->left = node->right = NULL;
+	node->height = 1;
+	struct avl_node* parent = NULL;
+	struct avl_node** link = &tree->root;
+	bool is_first = true;
+	while (*link != NULL) {
+		parent = *link;
+		if (tree->less(node, parent)) {
+			link = &parent->left;
+		} else {
+			link = &parent->right;
+			is_first = false;
+		}
+	}
+	*link = node;
+	node->parent = parent;
+	if (is_first) {
+		tree->first = node;
+	}
+	avl_rebalance(tree, parent);
+}
+
+void avl_delete(struct avl_tree* tree, struct avl_node* node) {
+	if (tree->first == node) {
+		tree->first = avl_next(node);
+	}
+	struct avl_node* rebalance_from;
+	if (node->left != NULL && node->right != NULL) {
+		// Successor takes place of the node
+		struct avl_node* next = avl_leftmost(node->right);
+		if (next->parent == node) {
+			rebalance_from = next;
+		} else {
+			rebalance_from = next->parent;
+			next->parent->left = next->right;
+			if (next->right != NULL) {
+				next->right->parent = next->parent;
+			}
+			next->right = node->right;
+			node->right->parent = next;
+		}
+		next->left = node->left;
+		node->left->parent = next;
+		next->height = node->height;
+		avl_replace_child(tree, node->parent, node, next);
+	} else {
+		struct avl_node* child = node->left != NULL ? node->left : node->right;
+		rebalance_from = node->parent;
+		avl_replace_child(tree, node->parent, node, child);
+	}
+	avl_rebalance(tree, rebalance_from);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Intrusive AVL tree, ordered by a comparator. Equal nodes go after existing ones.
+struct avl_node {
+	struct avl_node* parent;
+	struct avl_node* left;
+	struct avl_node* right;
+	int height;
+};
+
+typedef bool (*avl_less_t)(struct avl_node* a, struct avl_node* b);
+
+struct avl_tree {
+	struct avl_node* root;
+	// Leftmost node, so the smallest is taken in O(1)
+	struct avl_node* first;
+	avl_less_t less;
+};
+
+void avl_init(struct avl_tree* tree, avl_less_t less);
+bool avl_empty(struct avl_tree* tree);
+struct avl_node* avl_first(struct avl_tree* tree);
+struct avl_node* avl_next(struct avl_node* node);
+
+void avl_insert(struct avl_tree* tree, struct avl_node* node);
+void avl_delete(struct avl_tree* tree, struct avl_node* node);
+
+#define AVL_ENTRY(node, type, member) ( (type*) ((char*)(node) - offsetof(type, member)) )
@@ -0,0 +1,724 @@
+// Host benchmark & fuzzer for buddy and SLAB allocators.
+// Usage: bench-host [seed [ops]]
+
+#include "host-shim.h"
+#include "buddy.h"
+#include "slab-allocator.h"
+#include "kmalloc.h"
+#include "fs.h"
+#include "bootstrap-alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ARENA_SIZE   (1ull << 30)
+#define ARENA_PAGES  (ARENA_SIZE / PAGE_SIZE)
+#define MAX_LIVE     (1 << 16)
+
+static uint64_t seed = 1;
+static uint64_t ops = 2000000;
+
+static uint64_t bench_random(void) {
+	// xorshift64*
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ull;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int failures = 0;
+
+#define check(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAIL: " __VA_ARGS__); \
+		printf("\n"); \
+		++failures; \
+	} \
+} while (0)
+
+// Buddy
+
+// Shadow of arena: which pages are handed out
+static uint8_t shadow[ARENA_PAGES / 8];
+
+static bool shadow_get(uint64_t page) {
+	return (shadow[page / 8] >> (page % 8)) & 1;
+}
+
+static void shadow_set(uint64_t page, bool value) {
+	if (value) {
+		shadow[page / 8] |= 1 << (page % 8);
+	} else {
+		shadow[page / 8] &= ~(1 << (page % 8));
+	}
+}
+
+struct buddy_block {
+	phys_t start;
+	uint64_t pages;
+	bool is_exact; // buddy_alloc_pages or buddy_alloc
+};
+
+static struct buddy_block blocks[MAX_LIVE];
+static int blocks_count;
+
+static bool buddy_take(phys_t start, uint64_t pages) {
+	if (start % PAGE_SIZE != 0 || start + pages * PAGE_SIZE > ARENA_SIZE) {
+		return false;
+	}
+	for (uint64_t i = 0; i != pages; ++i) {
+		if (shadow_get(start / PAGE_SIZE + i)) {
+			return false;
+		}
+	}
+	for (uint64_t i = 0; i != pages; ++i) {
+		shadow_set(start / PAGE_SIZE + i, true);
+		// Allocator keeps its lists in free pages, they must not leak into ours
+		*(uint64_t*)va(start + i * PAGE_SIZE) = start + i * PAGE_SIZE;
+	}
+	return true;
+}
+
+static bool buddy_release(phys_t start, uint64_t pages) {
+	bool is_ok = true;
+	for (uint64_t i = 0; i != pages; ++i) {
+		is_ok = is_ok && shadow_get(start / PAGE_SIZE + i);
+		is_ok = is_ok && *(uint64_t*)va(start + i * PAGE_SIZE) == start + i * PAGE_SIZE;
+		shadow_set(start / PAGE_SIZE + i, false);
+	}
+	return is_ok;
+}
+
+static void buddy_block_free(int id) {
+	struct buddy_block* block = &blocks[id];
+	check(buddy_release(block->start, block->pages), "block %p (%llu pages) was corrupted", (void*)block->start, (unsigned long long)block->pages);
+	if (block->is_exact) {
+		buddy_free_pages(block->start, block->pages);
+	} else {
+		buddy_free(block->start);
+	}
+	blocks[id] = blocks[--blocks_count];
+}
+
+// Share of free memory in blocks smaller than 2^level pages
+static double buddy_unusable(struct buddy_stats* stats, int level) {
+	uint64_t usable = 0;
+	for (int i = level; i != BUDDY_LEVELS; ++i) {
+		usable += stats->free_count[i] << i;
+	}
+	return stats->free_pages ? 1.0 - (double)usable / stats->free_pages : 0.0;
+}
+
+static void bench_buddy(void) {
+	printf("buddy: %llu random ops\n", (unsigned long long)ops);
+	struct buddy_stats initial;
+	buddy_drain_caches();
+	buddy_get_stats(&initial);
+
+	uint64_t allocs = 0, frees = 0, fails = 0;
+	double start = now();
+	for (uint64_t op = 0; op != ops; ++op) {
+		// Keep roughly half of memory in use
+		bool do_alloc = blocks_count == 0 || (blocks_count != MAX_LIVE && bench_random() % 2 == 0);
+		if (!do_alloc) {
+			int id = bench_random() % blocks_count;
+			struct buddy_block* block = &blocks[id];
+			if (block->is_exact && block->pages > 1 && bench_random() % 4 == 0) {
+				// Shrinks as a file does on close, the rest is freed later by count
+				uint64_t new_pages = 1 + bench_random() % (block->pages - 1);
+				check(buddy_release(block->start + new_pages * PAGE_SIZE, block->pages - new_pages),
+						"block %p tail was corrupted", (void*)block->start);
+				buddy_trim_pages(block->start, block->pages, new_pages);
+				block->pages = new_pages;
+				// Some block is freed anyway, or live set grows until shrinker takes the caches' pages
+				id = bench_random() % blocks_count;
+			}
+			buddy_block_free(id);
+			++frees;
+			continue;
+		}
+		struct buddy_block* block = &blocks[blocks_count];
+		uint64_t kind = bench_random() % 100;
+		if (kind < 55) {
+			block->pages = 1;
+		} else if (kind < 75) {
+			block->pages = 2;
+		} else if (kind < 85) {
+			block->pages = 1ull << (2 + bench_random() % 3);
+		} else {
+			block->pages = 1 + bench_random() % 32;
+		}
+		block->is_exact = kind >= 85;
+		if (block->is_exact) {
+			block->start = buddy_alloc_pages(block->pages);
+		} else {
+			block->start = buddy_alloc(__builtin_ctzll(block->pages));
+		}
+		if (block->start == (phys_t)NULL) {
+			++fails;
+			continue;
+		}
+		check(buddy_take(block->start, block->pages), "block %p (%llu pages) overlaps", (void*)block->start, (unsigned long long)block->pages);
+		if (!block->is_exact) {
+			check(block->start % (block->pages * PAGE_SIZE) == 0, "block %p is not aligned", (void*)block->start);
+		}
+		++blocks_count;
+		++allocs;
+	}
+	double elapsed = now() - start;
+
+	struct buddy_stats stats;
+	buddy_get_stats(&stats);
+	printf("  %.0f ops/sec (%llu allocs, %llu frees, %llu failed)\n",
+			ops / elapsed, (unsigned long long)allocs, (unsigned long long)frees, (unsigned long long)fails);
+	printf("  live blocks %d, free pages %llu, cached pages %llu\n",
+			blocks_count, (unsigned long long)stats.free_pages, (unsigned long long)stats.cached_pages);
+	printf("  fragmentation: %.3f unusable for level 4, %.3f for level 9 (%.3f, %.3f initially)\n",
+			buddy_unusable(&stats, 4), buddy_unusable(&stats, 9), buddy_unusable(&initial, 4), buddy_unusable(&initial, 9));
+
+	while (blocks_count != 0) {
+		buddy_block_free(blocks_count - 1);
+	}
+	buddy_drain_caches();
+	buddy_get_stats(&stats);
+	check(stats.free_pages == initial.free_pages, "%llu pages lost", (unsigned long long)(initial.free_pages - stats.free_pages));
+	for (int level = 0; level != BUDDY_LEVELS; ++level) {
+		check(stats.free_count[level] == initial.free_count[level], "level %d is not coalesced: %llu blocks, %llu initially",
+				level, (unsigned long long)stats.free_count[level], (unsigned long long)initial.free_count[level]);
+	}
+}
+
+// SLAB
+
+struct slab_object {
+	void* ptr;
+	int cache;
+	uint8_t pattern;
+};
+
+static struct slab_object objects[MAX_LIVE];
+static int objects_count;
+
+static const uint16_t slab_sizes[] = {8, 24, 64, 200, 352, 700, 2000};
+#define SLAB_CACHES (sizeof(slab_sizes) / sizeof(slab_sizes[0]))
+static struct slab_allocator slab_caches[SLAB_CACHES];
+
+static void slab_object_free(int id) {
+	struct slab_object* object = &objects[id];
+	uint8_t* data = (uint8_t*)object->ptr;
+	bool is_ok = true;
+	for (int i = 0; i != slab_sizes[object->cache]; ++i) {
+		is_ok = is_ok && data[i] == object->pattern;
+	}
+	check(is_ok, "object %p of size %hu was corrupted", object->ptr, slab_sizes[object->cache]);
+	slab_free(object->ptr);
+	objects[id] = objects[--objects_count];
+}
+
+// Pages owned by some slab. Free slots of big slabs are nodes of an internal cache,
+// which keeps its pages after the caches are gone.
+static uint64_t slab_owned_pages(void) {
+	uint64_t count = 0;
+	for (int i = 0; i != bootstrap_mmap_length / (int)sizeof(struct mmap_entry); ++i) {
+		struct mmap_entry* entry = &bootstrap_mmap[i];
+		for (phys_t page = entry->base_addr; page < entry->base_addr + entry->length; page += PAGE_SIZE) {
+			count += page_descr_for(page)->slab != NULL;
+		}
+	}
+	return count;
+}
+
+static void bench_slab(void) {
+	printf("slab: %llu random ops over sizes", (unsigned long long)ops);
+	struct buddy_stats initial;
+	buddy_drain_caches();
+	buddy_get_stats(&initial);
+	uint64_t initial_owned = slab_owned_pages();
+	for (unsigned i = 0; i != SLAB_CACHES; ++i) {
+		printf(" %hu", slab_sizes[i]);
+		slab_init(&slab_caches[i], "bench", slab_sizes[i], 8);
+	}
+	printf("\n");
+
+	uint64_t allocs = 0, frees = 0, fails = 0;
+	double start = now();
+	for (uint64_t op = 0; op != ops; ++op) {
+		bool do_alloc = objects_count == 0 || (objects_count != MAX_LIVE && bench_random() % 2 == 0);
+		if (!do_alloc) {
+			slab_object_free(bench_random() % objects_count);
+			++frees;
+			continue;
+		}
+		struct slab_object* object = &objects[objects_count];
+		// Smaller objects are more common
+		object->cache = __builtin_ctzll(bench_random() | (1ull << (SLAB_CACHES - 1)));
+		object->ptr = slab_alloc(&slab_caches[object->cache]);
+		if (object->ptr == NULL) {
+			++fails;
+			continue;
+		}
+		check((uintptr_t)object->ptr % 8 == 0, "object %p is not aligned", object->ptr);
+		object->pattern = bench_random();
+		for (int i = 0; i != slab_sizes[object->cache]; ++i) {
+			((uint8_t*)object->ptr)[i] = object->pattern;
+		}
+		++objects_count;
+		++allocs;
+	}
+	double elapsed = now() - start;
+
+	for (unsigned i = 0; i != SLAB_CACHES; ++i) {
+		struct slab_stats slab_stats;
+		slab_get_stats(&slab_caches[i], &slab_stats);
+		printf("  size %4hu: order %d, %3hu objects per slab, %2d%% wasted, %hu colors, %llu active, %llu cached\n",
+				slab_sizes[i], slab_stats.order, slab_stats.objects_per_slab, slab_stats.waste_percent, slab_stats.colors,
+				(unsigned long long)slab_stats.objects_active, (unsigned long long)slab_stats.objects_cached);
+	}
+	struct buddy_stats stats;
+	buddy_get_stats(&stats);
+	printf("  %.0f ops/sec (%llu allocs, %llu frees, %llu failed)\n",
+			ops / elapsed, (unsigned long long)allocs, (unsigned long long)frees, (unsigned long long)fails);
+	printf("  live objects %d, pages in use %llu\n",
+			objects_count, (unsigned long long)(initial.free_pages - stats.free_pages - stats.cached_pages));
+
+	while (objects_count != 0) {
+		slab_object_free(objects_count - 1);
+	}
+	for (unsigned i = 0; i != SLAB_CACHES; ++i) {
+		struct slab_allocator* cache = &slab_caches[i];
+		check(cache->allocs == cache->frees, "size %hu: %llu allocs, but %llu frees", slab_sizes[i],
+				(unsigned long long)cache->allocs, (unsigned long long)cache->frees);
+		struct slab_stats slab_stats;
+		slab_get_stats(cache, &slab_stats);
+		check(cache->slabs == slab_stats.slabs_full + slab_stats.slabs_partial + slab_stats.slabs_empty,
+				"size %hu: %llu slabs counted", slab_sizes[i], (unsigned long long)cache->slabs);
+		slab_finit(&slab_caches[i]);
+	}
+	buddy_drain_caches();
+	buddy_get_stats(&stats);
+	uint64_t kept = initial.free_pages - stats.free_pages;
+	uint64_t owned = slab_owned_pages() - initial_owned;
+	check(kept == owned, "%lld pages kept after slab_finit, slab owns %lld of them", (long long)kept, (long long)owned);
+}
+
+// Alloc & free latency against the number of slabs in a cache
+static void bench_slab_free(void) {
+	printf("slab burst: 64 byte objects, freed in random order\n");
+	static void* ptrs[MAX_LIVE];
+	for (int count = 1 << 8; count <= MAX_LIVE; count <<= 2) {
+		struct buddy_stats initial;
+		buddy_get_stats(&initial);
+		initial.free_pages += initial.cached_pages;
+		struct slab_allocator cache;
+		slab_init(&cache, "bench", 64, 8);
+		int allocated = 0;
+		double start = now();
+		while (allocated != count) {
+			ptrs[allocated] = slab_alloc(&cache);
+			if (ptrs[allocated] == NULL) {
+				break;
+			}
+			++allocated;
+		}
+		double alloc_elapsed = now() - start;
+		for (int i = allocated - 1; i > 0; --i) {
+			int j = bench_random() % (i + 1);
+			void* ptr = ptrs[i];
+			ptrs[i] = ptrs[j];
+			ptrs[j] = ptr;
+		}
+		struct buddy_stats stats;
+		buddy_get_stats(&stats);
+		uint64_t free_pages = stats.free_pages + stats.cached_pages;
+		start = now();
+		for (int i = 0; i != allocated; ++i) {
+			slab_free(ptrs[i]);
+		}
+		double free_elapsed = now() - start;
+		buddy_get_stats(&stats);
+		printf("  %6d objects: %.1f ns per alloc, %.1f ns per free, %llu of %llu pages returned\n",
+				allocated, alloc_elapsed * 1e9 / allocated, free_elapsed * 1e9 / allocated,
+				(unsigned long long)(stats.free_pages + stats.cached_pages - free_pages),
+				(unsigned long long)(initial.free_pages - free_pages));
+		check(allocated == count, "only %d of %d objects allocated", allocated, count);
+		slab_finit(&cache);
+	}
+}
+
+// Alloc & free pairs over a few live objects, like fd churn
+static void bench_slab_churn(void) {
+	struct slab_allocator cache;
+	slab_init(&cache, "bench", 16, 8);
+	void* ptrs[8];
+	for (int i = 0; i != 8; ++i) {
+		ptrs[i] = slab_alloc(&cache);
+	}
+	double start = now();
+	for (uint64_t op = 0; op != ops; ++op) {
+		int id = op % 8;
+		slab_free(ptrs[id]);
+		ptrs[id] = slab_alloc(&cache);
+	}
+	double elapsed = now() - start;
+	printf("slab churn: %.1f ns per free & alloc pair\n", elapsed * 1e9 / ops);
+	for (int i = 0; i != 8; ++i) {
+		slab_free(ptrs[i]);
+	}
+	slab_finit(&cache);
+}
+
+// Constructed objects must come back intact, constructor runs once per object
+struct bench_ctor_object {
+	uint64_t words[5];
+};
+
+// Bulk API against per-object loop, alloc & free timed separately
+#define BULK_COUNT 256
+
+static void bench_bulk_print(const char* name, double* times, uint64_t objects) {
+	printf("  %-18s %.1f ns per alloc, %.1f ns per free\n", name, times[0] * 1e9 / objects, times[1] * 1e9 / objects);
+}
+
+static void bench_bulk(void) {
+	printf("bulk: %d objects or pages at once\n", BULK_COUNT);
+	uint64_t rounds = ops / BULK_COUNT + 1;
+	uint64_t objects = rounds * BULK_COUNT;
+
+	struct slab_allocator cache;
+	slab_init(&cache, "bench", 64, 8);
+	void* ptrs[BULK_COUNT];
+	double times[2] = {0, 0};
+	for (uint64_t round = 0; round != rounds; ++round) {
+		double start = now();
+		for (int i = 0; i != BULK_COUNT; ++i) {
+			ptrs[i] = slab_alloc(&cache);
+		}
+		double middle = now();
+		for (int i = 0; i != BULK_COUNT; ++i) {
+			slab_free(ptrs[i]);
+		}
+		times[0] += middle - start;
+		times[1] += now() - middle;
+	}
+	bench_bulk_print("slab loop:", times, objects);
+	times[0] = times[1] = 0;
+	for (uint64_t round = 0; round != rounds; ++round) {
+		double start = now();
+		int count = slab_alloc_bulk(&cache, BULK_COUNT, ptrs);
+		times[0] += now() - start;
+		check(count == BULK_COUNT, "slab_alloc_bulk gave %d objects", count);
+		if (round == 0) {
+			// Objects must not overlap
+			for (int i = 0; i != count; ++i) {
+				for (int j = 0; j != 64; ++j) {
+					((uint8_t*)ptrs[i])[j] = i;
+				}
+			}
+			for (int i = 0; i != count; ++i) {
+				check(((uint8_t*)ptrs[i])[0] == (uint8_t)i && ((uint8_t*)ptrs[i])[63] == (uint8_t)i,
+						"object %p from slab_alloc_bulk is shared", ptrs[i]);
+			}
+		}
+		double middle = now();
+		slab_free_bulk(&cache, count, ptrs);
+		times[1] += now() - middle;
+	}
+	bench_bulk_print("slab bulk:", times, objects);
+	check(cache.allocs == cache.frees && cache.allocs == 2 * objects, "%llu allocs & %llu frees counted",
+			(unsigned long long)cache.allocs, (unsigned long long)cache.frees);
+	slab_finit(&cache);
+
+	phys_t pages[BULK_COUNT];
+	times[0] = times[1] = 0;
+	for (uint64_t round = 0; round != rounds; ++round) {
+		double start = now();
+		for (int i = 0; i != BULK_COUNT; ++i) {
+			pages[i] = buddy_alloc(0);
+		}
+		double middle = now();
+		for (int i = 0; i != BULK_COUNT; ++i) {
+			buddy_free(pages[i]);
+		}
+		times[0] += middle - start;
+		times[1] += now() - middle;
+	}
+	bench_bulk_print("buddy loop:", times, objects);
+	times[0] = times[1] = 0;
+	for (uint64_t round = 0; round != rounds; ++round) {
+		double start = now();
+		int count = buddy_alloc_bulk(0, BULK_COUNT, pages);
+		times[0] += now() - start;
+		check(count == BULK_COUNT, "buddy_alloc_bulk gave %d pages", count);
+		if (round == 0) {
+			for (int i = 0; i != count; ++i) {
+				check(buddy_take(pages[i], 1), "page %llx from buddy_alloc_bulk is taken twice", (unsigned long long)pages[i]);
+			}
+			for (int i = 0; i != count; ++i) {
+				buddy_release(pages[i], 1);
+			}
+		}
+		double middle = now();
+		buddy_free_bulk(pages, count);
+		times[1] += now() - middle;
+	}
+	bench_bulk_print("buddy bulk:", times, objects);
+}
+
+// One object kept in each slab, like the first threads of a burst, and a field of them read over and over.
+// Without colors all of them are at the same page offset and fight for a few cache sets.
+#define COLOR_SURVIVORS 1024
+static void* color_survivors[COLOR_SURVIVORS];
+
+static void bench_slab_color_size(uint16_t size, const char* name) {
+	struct slab_allocator cache;
+	slab_init(&cache, "bench", size, 8);
+	struct slab_stats slab_stats;
+	slab_get_stats(&cache, &slab_stats);
+	int count = 0;
+	uint64_t offsets = 0;
+	struct slab* last = NULL;
+	for (int i = 0; i != MAX_LIVE && count != COLOR_SURVIVORS; ++i) {
+		void* ptr = slab_alloc(&cache);
+		objects[i].ptr = ptr;
+		struct slab* slab = page_descr_for(pa(ptr))->slab;
+		if (slab != last) {
+			last = slab;
+			uint64_t offset = (uintptr_t)ptr % PAGE_SIZE / SLAB_COLOR_STEP;
+			offsets |= 1ull << (offset % 64);
+			color_survivors[count++] = ptr;
+			objects[i].ptr = NULL;
+		}
+		objects_count = i + 1;
+	}
+	while (objects_count != 0) {
+		slab_free(objects[--objects_count].ptr);
+	}
+	int used = __builtin_popcountll(offsets);
+	check(used == (slab_stats.colors < count ? slab_stats.colors : count),
+			"%d of %hu colors used by size %hu", used, slab_stats.colors, size);
+
+	uint64_t reads = ops * 4;
+	uint64_t sum = 0;
+	double start = now();
+	for (uint64_t done = 0; done < reads; done += count) {
+		for (int i = 0; i != count; ++i) {
+			sum += *(volatile uint64_t*)color_survivors[i];
+		}
+	}
+	double elapsed = now() - start;
+	printf("  %-16s %4hu bytes, %hu colors: %.2f ns per read\n", name, size, slab_stats.colors, elapsed * 1e9 / reads + sum * 0);
+
+	for (int i = 0; i != count; ++i) {
+		slab_free(color_survivors[i]);
+	}
+	slab_finit(&cache);
+}
+
+static void bench_slab_color(void) {
+	printf("slab color: first object of %d slabs\n", COLOR_SURVIVORS);
+	// Same sizes both ways, so only the coloring differs
+	for (int is_coloring = 1; is_coloring >= 0; --is_coloring) {
+		printf(" coloring %s:\n", is_coloring ? "on" : "off");
+		slab_set_coloring(is_coloring);
+		bench_slab_color_size(sizeof(struct thread), "struct thread");
+		bench_slab_color_size(sizeof(struct file_desc), "struct file_desc");
+		bench_slab_color_size(700, "kmalloc-768");
+	}
+	slab_set_coloring(true);
+}
+
+static uint64_t bench_ctor_calls;
+static uint64_t bench_dtor_calls;
+
+static void bench_ctor(struct bench_ctor_object* object) {
+	for (int i = 0; i != 5; ++i) {
+		object->words[i] = (uintptr_t)object + i;
+	}
+	++bench_ctor_calls;
+}
+
+static void bench_dtor(struct bench_ctor_object* object) {
+	++bench_dtor_calls;
+}
+
+static void bench_slab_ctor(void) {
+	struct slab_allocator cache;
+	bench_ctor_calls = bench_dtor_calls = 0;
+	slab_init_ctor_for(&cache, struct bench_ctor_object, (slab_ctor_t)bench_ctor, (slab_dtor_t)bench_dtor);
+	static struct bench_ctor_object* ptrs[MAX_LIVE / 16];
+	const int max_count = sizeof(ptrs) / sizeof(ptrs[0]);
+	int count = 0;
+	uint64_t allocs = 0;
+	for (uint64_t op = 0; op != ops; ++op) {
+		if (count == max_count || (count != 0 && bench_random() % 2 == 0)) {
+			int id = bench_random() % count;
+			slab_free(ptrs[id]);
+			ptrs[id] = ptrs[--count];
+			continue;
+		}
+		struct bench_ctor_object* object = slab_alloc(&cache);
+		bool is_ok = true;
+		for (int i = 0; i != 5; ++i) {
+			is_ok = is_ok && object->words[i] == (uintptr_t)object + i;
+		}
+		check(is_ok, "object %p is not in constructed state", object);
+		ptrs[count++] = object;
+		++allocs;
+	}
+	while (count != 0) {
+		slab_free(ptrs[--count]);
+	}
+	slab_finit(&cache);
+	printf("slab ctor: %llu allocs, %llu constructor calls\n", (unsigned long long)allocs, (unsigned long long)bench_ctor_calls);
+	check(bench_ctor_calls == bench_dtor_calls, "%llu constructor, but %llu destructor calls",
+			(unsigned long long)bench_ctor_calls, (unsigned long long)bench_dtor_calls);
+}
+
+// Exhaust buddy while a cache holds many empty slabs, shrinker must give them back
+static void bench_shrink(void) {
+	struct slab_allocator cache;
+	slab_init(&cache, "bench", 64, 8);
+	slab_set_empty_max(&cache, UINT32_MAX);
+	static void* ptrs[MAX_LIVE];
+	for (int i = 0; i != MAX_LIVE; ++i) {
+		ptrs[i] = slab_alloc(&cache);
+	}
+	for (int i = 0; i != MAX_LIVE; ++i) {
+		slab_free(ptrs[i]);
+	}
+	struct slab_stats slab_stats;
+	slab_get_stats(&cache, &slab_stats);
+	struct buddy_stats stats;
+	buddy_get_stats(&stats);
+	uint64_t expected = stats.free_pages + stats.cached_pages + slab_stats.pages;
+
+	static phys_t pages[ARENA_PAGES];
+	uint64_t count = 0;
+	while (count != ARENA_PAGES && (pages[count] = buddy_alloc(0)) != (phys_t)NULL) {
+		++count;
+	}
+	slab_get_stats(&cache, &slab_stats);
+	printf("shrink: %llu pages allocated, %llu expected, %llu kept by cache\n",
+			(unsigned long long)count, (unsigned long long)expected, (unsigned long long)slab_stats.pages);
+	// A slab may stay because of objects in magazines
+	check(count + slab_stats.pages >= expected && slab_stats.pages <= 1, "cache did not give its pages back");
+	while (count != 0) {
+		buddy_free(pages[--count]);
+	}
+	slab_finit(&cache);
+}
+
+// Random sizes up to a few pages, with some of blocks grown by krealloc
+static void bench_kmalloc(void) {
+	printf("kmalloc: %llu random ops\n", (unsigned long long)ops);
+
+	static struct {
+		uint8_t* ptr;
+		size_t size;
+		uint8_t pattern;
+	} blocks[MAX_LIVE / 8];
+	const int max_blocks = sizeof(blocks) / sizeof(blocks[0]);
+	int count = 0;
+	uint64_t fails = 0;
+	double start = now();
+	for (uint64_t op = 0; op != ops; ++op) {
+		uint64_t kind = bench_random() % 8;
+		if (count == max_blocks || (count != 0 && kind < 3)) {
+			int id = bench_random() % count;
+			for (size_t i = 0; i != blocks[id].size; ++i) {
+				if (blocks[id].ptr[i] != blocks[id].pattern) {
+					check(false, "block %p of size %llu was corrupted", blocks[id].ptr, (unsigned long long)blocks[id].size);
+					break;
+				}
+			}
+			if (kind == 0) {
+				size_t size = blocks[id].size + 1 + bench_random() % (blocks[id].size + 1);
+				uint8_t* ptr = krealloc(blocks[id].ptr, size, 0);
+				if (ptr == NULL) {
+					++fails;
+					continue;
+				}
+				check(ksize(ptr) >= size, "ksize(%p) is %llu after krealloc to %llu", ptr,
+						(unsigned long long)ksize(ptr), (unsigned long long)size);
+				for (size_t i = blocks[id].size; i != size; ++i) {
+					ptr[i] = blocks[id].pattern;
+				}
+				blocks[id].ptr = ptr;
+				blocks[id].size = size;
+			} else {
+				kfree(blocks[id].ptr);
+				blocks[id] = blocks[--count];
+			}
+			continue;
+		}
+		// Mostly small
+		size_t size = 1 + bench_random() % (bench_random() % 16 == 0 ? 4 * PAGE_SIZE : 256);
+		uint8_t* ptr = kmalloc(size, KMALLOC_ZERO);
+		if (ptr == NULL) {
+			++fails;
+			continue;
+		}
+		bool is_zero = true;
+		for (size_t i = 0; i != size; ++i) {
+			is_zero = is_zero && ptr[i] == 0;
+		}
+		check(is_zero, "kmalloc(%llu, KMALLOC_ZERO) is not zeroed", (unsigned long long)size);
+		check((uintptr_t)ptr % 8 == 0, "block %p is not aligned", ptr);
+		blocks[count].ptr = ptr;
+		blocks[count].size = size;
+		blocks[count].pattern = bench_random();
+		for (size_t i = 0; i != size; ++i) {
+			ptr[i] = blocks[count].pattern;
+		}
+		++count;
+	}
+	double elapsed = now() - start;
+	printf("  %.0f ops/sec (%llu failed), live blocks %d\n", ops / elapsed, (unsigned long long)fails, count);
+	while (count != 0) {
+		kfree(blocks[--count].ptr);
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1) {
+		seed = strtoull(argv[1], NULL, 0);
+	}
+	if (argc > 2) {
+		ops = strtoull(argv[2], NULL, 0);
+	}
+	host_init(ARENA_SIZE);
+	// Something alike to QEMU: hole below 1 MiB and in the middle
+	host_mmap_add(BIOS_SIZE, ARENA_SIZE / 2 - BIOS_SIZE);
+	host_mmap_add(ARENA_SIZE / 2 + ARENA_SIZE / 8, ARENA_SIZE / 2 - ARENA_SIZE / 8);
+
+	shrinkers_init();
+	buddy_init();
+	buddy_init_high();
+	slab_allocators_init();
+	kmalloc_init();
+
+	bench_buddy();
+	bench_slab();
+	bench_slab_free();
+	bench_slab_churn();
+	bench_bulk();
+	bench_slab_color();
+	bench_slab_ctor();
+	bench_shrink();
+	bench_kmalloc();
+
+	slabinfo();
+
+	if (failures != 0) {
+		printf("%d checks FAILED\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,185 @@
+// Userspace replacements for what allocators need from the kernel.
+// Benchmark is single-threaded, so locks only check they are used properly.
+
+#include "host-shim.h"
+#include "bootstrap-alloc.h"
+#include "threads.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+
+uintptr_t host_phys_base;
+
+int bootstrap_mmap_length = 0;
+struct mmap_entry bootstrap_mmap[BOOTSTRAP_MMAP_MAX_LENGTH];
+
+static int host_log_level = LEVEL_WARN;
+
+void host_init(uint64_t arena_size) {
+	const char* level = getenv("BENCH_LOG");
+	if (level != NULL) {
+		host_log_level = atoi(level);
+	}
+	void* arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (arena == MAP_FAILED) {
+		halt("Cannot map %llu bytes arena.", arena_size);
+	}
+	host_phys_base = (uintptr_t)arena;
+}
+
+void host_mmap_add(phys_t base, uint64_t length) {
+	struct mmap_entry* entry = &bootstrap_mmap[bootstrap_mmap_length / sizeof(struct mmap_entry)];
+	entry->size = MMAP_ENTRY_SIZE;
+	entry->base_addr = base;
+	entry->length = length;
+	entry->type = MMAP_ENTRY_TYPE_AVAILABLE;
+	bootstrap_mmap_length += sizeof(struct mmap_entry);
+}
+
+// Bootstrap allocator
+
+void bootstrap_init_mmap(void) {
+	print_mmap(bootstrap_mmap, bootstrap_mmap_length);
+}
+
+phys_t bootstrap_alloc(uint32_t size) {
+	for (int i = 0; i != bootstrap_mmap_length / (int)sizeof(struct mmap_entry); ++i) {
+		struct mmap_entry* entry = &bootstrap_mmap[i];
+		if (entry->type == MMAP_ENTRY_TYPE_AVAILABLE && entry->length >= size) {
+			phys_t result = entry->base_addr;
+			entry->base_addr += size;
+			entry->length -= size;
+			return result;
+		}
+	}
+	return 0;
+}
+
+// Threads
+
+uint64_t hard_lock() {
+	return 0;
+}
+
+void hard_unlock(uint64_t rflags) {
+}
+
+uint64_t hard_spin_lock(struct spinlock* lock) {
+	if (lock->is_locked) {
+		halt("Spinlock %p is locked twice.", lock);
+	}
+	lock->is_locked = 1;
+	return 0;
+}
+
+void hard_spin_unlock(struct spinlock* lock, uint64_t rflags) {
+	if (!lock->is_locked) {
+		halt("Spinlock %p is not locked.", lock);
+	}
+	lock->is_locked = 0;
+}
+
+int cpu_current_id(void) {
+	return 0;
+}
+
+void mutex_init(struct mutex* mutex) {
+	mutex->is_occupied = false;
+}
+
+void mutex_finit(struct mutex* mutex) {
+}
+
+void mutex_lock(struct mutex* mutex) {
+	if (mutex->is_occupied) {
+		halt("Mutex %p is locked twice.", mutex);
+	}
+	mutex->is_occupied = true;
+}
+
+bool mutex_try_lock(struct mutex* mutex) {
+	if (mutex->is_occupied) {
+		return false;
+	}
+	mutex->is_occupied = true;
+	return true;
+}
+
+void mutex_unlock(struct mutex* mutex) {
+	if (!mutex->is_occupied) {
+		halt("Mutex %p is not locked.", mutex);
+	}
+	mutex->is_occupied = false;
+}
+
+void cv_init(struct condition_variable* variable, struct mutex* mutex) {
+	variable->mutex = mutex;
+	list_init(&variable->threads_head);
+}
+
+void cv_finit(struct condition_variable* variable) {
+}
+
+void cv_wait(struct condition_variable* variable) {
+	halt("Nobody can notify %p.", variable);
+}
+
+void cv_notify(struct condition_variable* variable) {
+}
+
+void cv_notify_all(struct condition_variable* variable) {
+}
+
+void yield(void) {
+}
+
+// Threads just run to completion right away
+struct thread* thread_create(thread_func_t func, void* data, const char* name) {
+	static struct thread thread;
+	thread.name = name;
+	thread.data = func(data);
+	thread.is_over = true;
+	return &thread;
+}
+
+void* thread_join(struct thread* thread) {
+	return thread->data;
+}
+
+void thread_set_priority(struct thread* thread, int priority) {
+	thread->priority = priority;
+}
+
+struct thread* thread_current(void) {
+	return NULL;
+}
+
+// Log
+
+void vlog_tagged(int level, const char* tag, const char* format, va_list args) {
+	if (level < host_log_level) {
+		return;
+	}
+	fprintf(stderr, "[%02d %s] ", level, tag);
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+}
+
+void log_tagged(int level, const char* tag, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	vlog_tagged(level, tag, format, args);
+	va_end(args);
+}
+
+void halt_tagged(const char* tag, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	vlog_tagged(LEVEL_FAULT, tag, format, args);
+	va_end(args);
+	abort();
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "memory.h"
+#include <stdint.h>
+
+void host_init(uint64_t arena_size);
+void host_mmap_add(phys_t base, uint64_t length);
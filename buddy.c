@@ -1,94 +1,151 @@
 #include "bootstrap-alloc.h"
 #include "memory.h"
 #include "buddy.h"
+#include "shrinker.h"
 #include "log.h"
+#include "utils.h"
 #include <stdbool.h>
 
 struct buddy_allocator buddy_allocator;
 
-// Convert buddy node number to/from pointer to node
-static inline struct buddy_node* buddy_node_from_no(buddy_node_no number) {
-	if (number >= 0) {
-		return &buddy_allocator.nodes[number];
-	} else {
-		return &buddy_allocator.node_list_starts[number + BUDDY_LEVELS - 1];
-	}
+// Convert page number to/from page adress
+static inline buddy_page_no buddy_page_from_address(phys_t adress) {
+	return adress / PAGE_SIZE;
+}
+
+static inline phys_t buddy_page_to_address(buddy_page_no no) {
+	return (phys_t)no * PAGE_SIZE;
+}
+
+static inline struct buddy_section* buddy_section_get(buddy_page_no page) {
+	return &buddy_allocator.sections[page >> BUDDY_SECTION_BITS];
+}
+
+static inline struct buddy_page* buddy_page_get(buddy_page_no page) {
+	return &buddy_section_get(page)->pages[page & (BUDDY_SECTION_PAGES - 1)];
 }
 
-static inline buddy_node_no buddy_node_to_no(struct buddy_node* node_p) {
-	if (node_p >= buddy_allocator.nodes && node_p < buddy_allocator.nodes + buddy_allocator.nodes_count) {
-		return node_p - buddy_allocator.nodes;
+static inline struct buddy_zone* buddy_zone_for(phys_t address) {
+	if (address < BUDDY_ZONE_LOW_END) {
+		return &buddy_allocator.zones[BUDDY_ZONE_LOW];
+	} else if (address < BUDDY_ZONE_DMA32_END) {
+		return &buddy_allocator.zones[BUDDY_ZONE_DMA32];
 	} else {
-		return node_p - buddy_allocator.node_list_starts - BUDDY_LEVELS + 1;
+		return &buddy_allocator.zones[BUDDY_ZONE_NORMAL];
 	}
 }
 
-// Get buddy number
-static inline buddy_node_no buddy_node_buddy(buddy_node_no node) {
-	if (node < 0) {
-		return BUDDY_NODE_NULL;
-	} else {
-		return node ^ (1 << buddy_node_from_no(node)->level);
+// Get buddy number, or -1 if it is out of memory or zone
+static inline buddy_page_no buddy_page_buddy(struct buddy_zone* zone, buddy_page_no page) {
+	buddy_page_no buddy = page ^ (1ull << buddy_page_get(page)->level);
+	if (buddy >= buddy_allocator.pages_count || !buddy_section_get(buddy)->is_ready) {
+		return (buddy_page_no)-1;
+	}
+	phys_t address = buddy_page_to_address(buddy);
+	if (address < zone->start || zone->end <= address) {
+		return (buddy_page_no)-1;
 	}
+	return buddy;
 }
 
-// Initialise buddy node
-static void buddy_node_init(buddy_node_no node) {
-	struct buddy_node* node_p = buddy_node_from_no(node);
-	node_p->level = 0;
-	node_p->is_free = false;
-	node_p->prev = BUDDY_NODE_NULL;
-	node_p->next = BUDDY_NODE_NULL;
-	page_descr_init(&node_p->page_descr);
+// Free block is linked through its first bytes
+static inline struct list_node* buddy_page_link(buddy_page_no page) {
+	return (struct list_node*)va(buddy_page_to_address(page));
 }
 
-// Convert buddy node number to/from page adress
-static inline buddy_node_no buddy_node_from_address(phys_t adress) {
-	return adress / PAGE_SIZE;
+static inline buddy_page_no buddy_page_from_link(struct list_node* link) {
+	return buddy_page_from_address(pa(link));
 }
 
-static inline phys_t buddy_node_to_address(buddy_node_no no) {
-	return (phys_t)no * PAGE_SIZE;
+// Insert block to the list of its level, marking it free
+static void buddy_page_insert(struct buddy_zone* zone, buddy_page_no page) {
+	struct buddy_page* page_p = buddy_page_get(page);
+	int level = page_p->level;
+	list_add(buddy_page_link(page), &zone->free_lists[level]);
+	page_p->is_free = true;
+
+	zone->free_levels |= 1u << level;
+	++zone->free_count[level];
+	zone->free_pages += 1ull << level;
 }
 
-// Insert node to list
-static void buddy_node_insert(buddy_node_no node, buddy_node_no before) {
-	struct buddy_node* node_p = buddy_node_from_no(node);
-	struct buddy_node* before_p = buddy_node_from_no(before);
-	node_p->next = before_p->next;
-	node_p->prev = before;
+// Delete block from list of its level, marking it used
+static void buddy_page_delete(struct buddy_zone* zone, buddy_page_no page) {
+	struct buddy_page* page_p = buddy_page_get(page);
+	int level = page_p->level;
+	list_delete(buddy_page_link(page));
+	page_p->is_free = false;
 
-	before_p->next = node;
-	if (node_p->next != BUDDY_NODE_NULL) {
-		buddy_node_from_no(node_p->next)->prev = node;
+	if (--zone->free_count[level] == 0) {
+		zone->free_levels &= ~(1u << level);
 	}
+	zone->free_pages -= 1ull << level;
 }
 
-// Delte node from list
-static void buddy_node_delete(buddy_node_no node) {
-	struct buddy_node* node_p = buddy_node_from_no(node);
+static void buddy_zone_init(struct buddy_zone* zone, const char* name, phys_t start, phys_t end) {
+	mutex_init(&zone->lock);
+	zone->name = name;
+	zone->start = start;
+	zone->end = end;
+	for (int level = 0; level != BUDDY_LEVELS; ++level) {
+		list_init(&zone->free_lists[level]);
+		zone->free_count[level] = 0;
+	}
+	zone->free_levels = 0;
+	zone->free_pages = 0;
+}
+
+// High memory
+// Memory above BOOTMEM_SIZE is freed in chunks by a background thread.
+// Allocations that find buddy empty free the next chunk themselves.
+
+#define BUDDY_HIGH_CHUNK (1ull * 1024ull * 1024ull * 1024ull)
+
+static struct {
+	struct mutex lock;
+	int entry;
+	phys_t pos;
+	bool is_done;
+	uint64_t start_tsc;
+	struct thread* thread;
+} buddy_high;
 
-	buddy_node_no prev = node_p->prev;
-	buddy_node_no next = node_p->next;
-	if (next) {
-		buddy_node_from_no(next)->prev = prev;
+// Pages start allocated, so section takes part in merges only once it is ready
+static void buddy_section_init(struct buddy_section* section_p) {
+	for (uint64_t i = 0; i != BUDDY_SECTION_PAGES; ++i) {
+		section_p->pages[i].level = 0;
+		section_p->pages[i].is_free = false;
+		page_descr_init(&section_p->page_descrs[i]);
 	}
-	if (prev) {
-		buddy_node_from_no(prev)->next = next;
+	barrier();
+	section_p->is_ready = true;
+}
+
+// Prepare present sections covering [start, end)
+static void buddy_sections_init(phys_t start, phys_t end) {
+	for (
+			uint64_t section = start / PAGE_SIZE >> BUDDY_SECTION_BITS;
+			section <= (end - 1) / PAGE_SIZE >> BUDDY_SECTION_BITS;
+			++section
+	) {
+		struct buddy_section* section_p = &buddy_allocator.sections[section];
+		if (section_p->pages != NULL && !section_p->is_ready) {
+			buddy_section_init(section_p);
+		}
 	}
-	node_p->prev = node_p->next = BUDDY_NODE_NULL;
 }
 
 enum buddy_init_iterator_mode {
 		MODE_CALC,
-		MODE_INIT_LOW,
-		MODE_INIT_HIGH
+		MODE_SECTIONS,
+		MODE_INIT_LOW
 };
 
 struct buddy_init_iterator {
 	struct mmap_iterator super;
 	enum buddy_init_iterator_mode mode;
 	uint64_t max_memory;
+	uint64_t available_memory;
 };
 
 static void __buddy_init_iterate(struct buddy_init_iterator* self, struct mmap_entry* entry) {
@@ -96,28 +153,26 @@ static void __buddy_init_iterate(struct buddy_init_iterator* self, struct mmap_e
 		return;
 	}
 	phys_t end = entry->base_addr + entry->length;
-	phys_t pos;
 	switch (self->mode) {
 		case MODE_CALC:
 			if (self->max_memory < end) {
 				self->max_memory = end;
 			}
+			self->available_memory += entry->length;
 			break;
-		case MODE_INIT_LOW:
-		case MODE_INIT_HIGH:
-			pos = entry->base_addr;
-			pos = ((pos + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE; // Align start
-			if (self->mode == MODE_INIT_HIGH && pos < BOOTMEM_SIZE) {
-				pos = BOOTMEM_SIZE;
-			}
-			while (pos + PAGE_SIZE <= end) {
-				if (self->mode == MODE_INIT_LOW && pos >= BOOTMEM_SIZE) {
-					break;
-				}
-				buddy_free(pos);
-				pos += PAGE_SIZE;
+		case MODE_SECTIONS:
+			// Just mark them for now, bootstrap_alloc would change mmap under us
+			for (
+					uint64_t section = entry->base_addr / PAGE_SIZE >> BUDDY_SECTION_BITS;
+					section <= (end - 1) / PAGE_SIZE >> BUDDY_SECTION_BITS;
+					++section
+			) {
+				buddy_allocator.sections[section].pages = (struct buddy_page*)-1;
 			}
 			break;
+		case MODE_INIT_LOW:
+			buddy_free_range(entry->base_addr, min_u64(end, BOOTMEM_SIZE));
+			break;
 	}
 }
 
@@ -125,104 +180,525 @@ static void buddy_init_iterator_init(struct buddy_init_iterator* self) {
 	self->super.iterate = (mmap_iterator_iterate_t)__buddy_init_iterate;
 	self->mode = MODE_CALC;
 	self->max_memory = 0;
+	self->available_memory = 0;
 }
 
 void buddy_init(void) {
 	bootstrap_init_mmap();
 
-	mutex_init(&buddy_allocator.lock);
+	buddy_zone_init(&buddy_allocator.zones[BUDDY_ZONE_LOW]   , "Low"   , 0                   , BUDDY_ZONE_LOW_END  );
+	buddy_zone_init(&buddy_allocator.zones[BUDDY_ZONE_DMA32] , "DMA32" , BUDDY_ZONE_LOW_END  , BUDDY_ZONE_DMA32_END);
+	buddy_zone_init(&buddy_allocator.zones[BUDDY_ZONE_NORMAL], "Normal", BUDDY_ZONE_DMA32_END, (phys_t)-1          );
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		spin_init(&buddy_allocator.page_caches[cpu].lock);
+		for (int level = 0; level != BUDDY_CACHE_LEVELS; ++level) {
+			buddy_allocator.page_caches[cpu].levels[level].count = 0;
+		}
+	}
 	struct buddy_init_iterator iterator;
 	buddy_init_iterator_init(&iterator);
 	mmap_iterate(bootstrap_mmap, bootstrap_mmap_length, (struct mmap_iterator*) &iterator);
-	buddy_allocator.nodes_count = iterator.max_memory / PAGE_SIZE;
-	log(LEVEL_INFO, "There is %p memory, will need %d nodes.", iterator.max_memory, buddy_allocator.nodes_count);
-	buddy_allocator.nodes = (struct buddy_node*)va(bootstrap_alloc(buddy_allocator.nodes_count * sizeof(struct buddy_node)));
-	log(LEVEL_LOG, "Allocated at %p.", buddy_allocator.nodes);
-	for (buddy_node_no i = BUDDY_NODE_START; i != buddy_allocator.nodes_count; ++i) {
-		buddy_node_init(i);
+	buddy_allocator.pages_count = iterator.max_memory / PAGE_SIZE;
+	buddy_allocator.sections_count = (buddy_allocator.pages_count + BUDDY_SECTION_PAGES - 1) >> BUDDY_SECTION_BITS;
+	log(
+			LEVEL_INFO, "There is %p memory, will need %llu pages in %llu sections.",
+			iterator.max_memory, buddy_allocator.pages_count, buddy_allocator.sections_count
+	);
+	uint64_t sections_size = buddy_allocator.sections_count * sizeof(struct buddy_section);
+	buddy_allocator.sections = (struct buddy_section*)va(bootstrap_alloc(sections_size));
+	for (uint64_t section = 0; section != buddy_allocator.sections_count; ++section) {
+		buddy_allocator.sections[section].pages = NULL;
+		buddy_allocator.sections[section].page_descrs = NULL;
+		buddy_allocator.sections[section].is_ready = false;
+	}
+	iterator.mode = MODE_SECTIONS;
+	mmap_iterate(bootstrap_mmap, bootstrap_mmap_length, (struct mmap_iterator*) &iterator);
+
+	uint64_t present = 0;
+	for (uint64_t section = 0; section != buddy_allocator.sections_count; ++section) {
+		struct buddy_section* section_p = &buddy_allocator.sections[section];
+		if (section_p->pages == NULL) {
+			continue;
+		}
+		++present;
+		section_p->pages = (struct buddy_page*)va(bootstrap_alloc(BUDDY_SECTION_PAGES * sizeof(struct buddy_page)));
+		section_p->page_descrs = (struct page_descr*)va(bootstrap_alloc(BUDDY_SECTION_PAGES * sizeof(struct page_descr)));
+		if (section_p->pages == va((phys_t)NULL) || section_p->page_descrs == va((phys_t)NULL)) {
+			halt("No memory for section %llu metadata.", section);
+		}
 	}
-	log(LEVEL_V, "Nodes init cycle completed.");
+	// Only low sections are filled now, so boot does not grow with RAM
+	buddy_sections_init(0, min_u64(iterator.max_memory, BOOTMEM_SIZE));
+	log(LEVEL_V, "Pages init cycle completed.");
+
+	uint64_t metadata_size = sections_size + present * BUDDY_SECTION_PAGES * (sizeof(struct buddy_page) + sizeof(struct page_descr));
+	uint64_t overhead = metadata_size * 10000 / iterator.available_memory;
+	log(
+			LEVEL_INFO,
+			"Page metadata: %llu bytes for %llu/%llu sections (%llu per page: %llu buddy + %llu descriptor), %llu.%02llu%% of available memory.",
+			metadata_size,
+			present,
+			buddy_allocator.sections_count,
+			sizeof(struct buddy_page) + sizeof(struct page_descr),
+			sizeof(struct buddy_page),
+			sizeof(struct page_descr),
+			overhead / 100,
+			overhead % 100
+	);
+
+	mutex_init(&buddy_high.lock);
+	buddy_high.entry = 0;
+	buddy_high.pos = 0;
+	buddy_high.is_done = false;
+	buddy_high.thread = NULL;
 
-	// Now all nodes think they are aloocated pages. We need to deallocate the available ones.
+	// Now all pages think they are allocated. We need to deallocate the available ones.
+	uint64_t start_tsc = rdtsc();
 	iterator.mode = MODE_INIT_LOW;
 	mmap_iterate(bootstrap_mmap, bootstrap_mmap_length, (struct mmap_iterator*) &iterator);
-	log(LEVEL_LOG, "Low memory freed.");
+	log(LEVEL_LOG, "Low memory freed in %llu cycles.", rdtsc() - start_tsc);
+}
+
+// Free next chunk of high memory, returns false if there was nothing left
+static bool buddy_init_high_step(void) {
+	mutex_lock(&buddy_high.lock);
+	int entries_count = bootstrap_mmap_length / sizeof(struct mmap_entry);
+	bool is_freed = false;
+	while (!is_freed && buddy_high.entry != entries_count) {
+		struct mmap_entry* entry = &bootstrap_mmap[buddy_high.entry];
+		phys_t end = entry->base_addr + entry->length;
+		if (entry->type != MMAP_ENTRY_TYPE_AVAILABLE || end <= BOOTMEM_SIZE) {
+			++buddy_high.entry;
+			continue;
+		}
+		phys_t start = max_u64(max_u64(entry->base_addr, BOOTMEM_SIZE), buddy_high.pos);
+		phys_t chunk_end = min_u64(start + BUDDY_HIGH_CHUNK, end);
+		buddy_sections_init(start, chunk_end);
+		buddy_free_range(start, chunk_end);
+		buddy_high.pos = chunk_end;
+		if (chunk_end == end) {
+			++buddy_high.entry;
+		}
+		is_freed = true;
+	}
+	buddy_high.is_done = !is_freed;
+	mutex_unlock(&buddy_high.lock);
+	return is_freed;
+}
+
+static void buddy_init_high_done(void) {
+	struct buddy_stats stats;
+	buddy_get_stats(&stats);
+	log(LEVEL_LOG, "High memory freed in %llu cycles, %llu pages are free.", rdtsc() - buddy_high.start_tsc, stats.free_pages);
+	for (int zone = 0; zone != BUDDY_ZONES; ++zone) {
+		log(LEVEL_LOG, "Zone %s: %llu pages are free.", buddy_allocator.zones[zone].name, stats.zone_free_pages[zone]);
+	}
+}
+
+static void* buddy_init_high_thread(void* data) {
+	while (buddy_init_high_step()) {
+		yield();
+	}
+	buddy_init_high_done();
+	return NULL;
 }
 
 void buddy_init_high(void) {
-	struct buddy_init_iterator iterator;
-	buddy_init_iterator_init(&iterator);
-	iterator.mode = MODE_INIT_HIGH;
-	mmap_iterate(bootstrap_mmap, bootstrap_mmap_length, (struct mmap_iterator*) &iterator);
-	log(LEVEL_LOG, "High memory freed.");
+	buddy_high.start_tsc = rdtsc();
+	buddy_high.thread = thread_create(buddy_init_high_thread, NULL, "buddy high");
+	if (buddy_high.thread == NULL) {
+		log(LEVEL_WARN, "No thread for high memory, freeing it now.");
+		buddy_init_high_thread(NULL);
+		return;
+	}
+	// Background work, allocations free what they need themselves
+	thread_set_priority(buddy_high.thread, THREAD_PRIORITY_IDLE);
 }
 
-static phys_t __buddy_alloc(int level) {
-	int alloc_level = level;
-	while (alloc_level < BUDDY_LEVELS && buddy_allocator.node_list_starts[alloc_level].next == BUDDY_NODE_NULL) {
-		++alloc_level;
+void buddy_init_high_join(void) {
+	if (buddy_high.thread != NULL) {
+		thread_join(buddy_high.thread);
+		buddy_high.thread = NULL;
 	}
-	if (alloc_level == BUDDY_LEVELS) {
+}
+
+static phys_t __buddy_alloc(struct buddy_zone* zone, int level) {
+	// Smallest non-empty level that fits
+	uint32_t levels = zone->free_levels & ~((1u << level) - 1);
+	if (levels == 0) {
 		return (phys_t)NULL;
 	}
+	int alloc_level = __builtin_ctz(levels);
 
-	buddy_node_no result = buddy_allocator.node_list_starts[alloc_level].next;
-	struct buddy_node* result_p = buddy_node_from_no(result);
-	result_p->is_free = false;
-	buddy_node_delete(result);
+	buddy_page_no result = buddy_page_from_link(list_first(&zone->free_lists[alloc_level]));
+	struct buddy_page* result_p = buddy_page_get(result);
+	buddy_page_delete(zone, result);
 	while (result_p->level > level) {
 		--result_p->level;
-		buddy_node_no buddy = buddy_node_buddy(result);
-		buddy_node_insert(buddy, buddy_node_to_no(&buddy_allocator.node_list_starts[result_p->level]));
+		buddy_page_no buddy = buddy_page_buddy(zone, result);
+		buddy_page_get(buddy)->level = result_p->level;
+		buddy_page_insert(zone, buddy);
 	}
-	return buddy_node_to_address(result);
-}
-
-phys_t buddy_alloc(int level) {
-	mutex_lock(&buddy_allocator.lock);
-	phys_t res = __buddy_alloc(level);
-	mutex_unlock(&buddy_allocator.lock);
-	return res;
+	return buddy_page_to_address(result);
 }
 
-static void __buddy_free(phys_t pointer) {
-	buddy_node_no node = buddy_node_from_address(pointer);
-	struct buddy_node* node_p = buddy_node_from_no(node);
-	if (node_p->is_free) {
-		return;
+static void __buddy_free(struct buddy_zone* zone, phys_t pointer) {
+	buddy_page_no page = buddy_page_from_address(pointer);
+	struct buddy_page* page_p = buddy_page_get(page);
+	if (page_p->is_free) {
+		halt("Double free of page %p in zone %s.", pointer, zone->name);
 	}
-	node_p->is_free = true;
-	buddy_node_insert(node, buddy_node_to_no(&buddy_allocator.node_list_starts[node_p->level]));
-	while (node_p->level != BUDDY_LEVELS - 1) {
-		buddy_node_no buddy = buddy_node_buddy(node);
-		if (buddy == BUDDY_NODE_NULL) {
+	buddy_page_insert(zone, page);
+	while (page_p->level != BUDDY_LEVELS - 1) {
+		buddy_page_no buddy = buddy_page_buddy(zone, page);
+		if (buddy == (buddy_page_no)-1) {
 			break;
 		}
-		struct buddy_node* buddy_p = buddy_node_from_no(buddy);
-		if (!buddy_p->is_free || buddy_p->level != node_p->level) {
+		struct buddy_page* buddy_p = buddy_page_get(buddy);
+		if (!buddy_p->is_free || buddy_p->level != page_p->level) {
 			break;
 		}
 
 		// Merge
-		buddy_node_no result        = (node < buddy) ? node : buddy;
-		struct buddy_node* result_p = (node < buddy) ? node_p : buddy_p;
+		buddy_page_no result        = (page < buddy) ? page : buddy;
+		struct buddy_page* result_p = (page < buddy) ? page_p : buddy_p;
 
+		buddy_page_delete(zone, page);
+		buddy_page_delete(zone, buddy);
 		result_p->level++;
-		buddy_node_delete(node);
-		buddy_node_delete(buddy);
-		buddy_node_insert(result, buddy_node_to_no(&buddy_allocator.node_list_starts[result_p->level]));
+		buddy_page_insert(zone, result);
+
+		page   = result;
+		page_p = result_p;
+	}
+}
+
+// Allocate up to count blocks, trying allowed zones from higher to lower, each lock taken once.
+// May sleep on zone locks.
+static int buddy_alloc_batch(int level, int zones, phys_t* pages, int count) {
+	int allocated = 0;
+	for (int zone_id = BUDDY_ZONES - 1; zone_id >= 0 && allocated != count; --zone_id) {
+		if ((zones & (1 << zone_id)) == 0) {
+			continue;
+		}
+		struct buddy_zone* zone = &buddy_allocator.zones[zone_id];
+		mutex_lock(&zone->lock);
+		while (allocated != count) {
+			phys_t page = __buddy_alloc(zone, level);
+			if (page == (phys_t)NULL) {
+				break;
+			}
+			pages[allocated++] = page;
+		}
+		mutex_unlock(&zone->lock);
+	}
+	return allocated;
+}
+
+// Free blocks, taking each zone lock once. May sleep on zone locks.
+static void buddy_free_batch(phys_t* pages, int count) {
+	for (int zone_id = 0; zone_id != BUDDY_ZONES; ++zone_id) {
+		struct buddy_zone* zone = &buddy_allocator.zones[zone_id];
+		bool is_locked = false;
+		for (int i = 0; i != count; ++i) {
+			if (buddy_zone_for(pages[i]) != zone) {
+				continue;
+			}
+			if (!is_locked) {
+				mutex_lock(&zone->lock);
+				is_locked = true;
+			}
+			__buddy_free(zone, pages[i]);
+		}
+		if (is_locked) {
+			mutex_unlock(&zone->lock);
+		}
+	}
+}
+
+// Page cache
+// Recently freed small blocks are kept in LIFO order, so they are handed out still cache-hot.
+// Each CPU has its own, under its spinlock. Zone locks may sleep, so they are taken with no cache locked,
+// batches are moved through local arrays. The thread may move meanwhile, so caches are looked up again.
+
+static struct buddy_cpu_caches* buddy_this_caches(void) {
+	return &buddy_allocator.page_caches[cpu_current_id()];
+}
 
-		node   = result;
-		node_p = result_p;
+static phys_t buddy_cache_alloc(int level) {
+	struct buddy_cpu_caches* caches = buddy_this_caches();
+	uint64_t rflags = hard_spin_lock(&caches->lock);
+	struct buddy_page_cache* cache = &caches->levels[level];
+	phys_t res = (phys_t)NULL;
+	if (cache->count != 0) {
+		res = cache->pages[--cache->count];
 	}
+	hard_spin_unlock(&caches->lock, rflags);
+	if (res != (phys_t)NULL) {
+		return res;
+	}
+
+	phys_t batch[BUDDY_CACHE_BATCH];
+	int batch_count = buddy_alloc_batch(level, BUDDY_ZONES_ALL, batch, BUDDY_CACHE_BATCH);
+	if (batch_count == 0) {
+		return (phys_t)NULL;
+	}
+	res = batch[--batch_count];
+	caches = buddy_this_caches();
+	rflags = hard_spin_lock(&caches->lock);
+	cache = &caches->levels[level];
+	while (batch_count != 0 && cache->count != BUDDY_CACHE_SIZE) {
+		cache->pages[cache->count++] = batch[--batch_count];
+	}
+	hard_spin_unlock(&caches->lock, rflags);
+	// Someone has refilled it while we were waiting
+	buddy_free_batch(batch, batch_count);
+	return res;
+}
+
+static void buddy_cache_free(phys_t pointer, int level) {
+	struct buddy_cpu_caches* caches = buddy_this_caches();
+	uint64_t rflags = hard_spin_lock(&caches->lock);
+	struct buddy_page_cache* cache = &caches->levels[level];
+	phys_t batch[BUDDY_CACHE_BATCH];
+	int batch_count = 0;
+	if (cache->count == BUDDY_CACHE_SIZE) {
+		// Give the coldest batch back
+		batch_count = BUDDY_CACHE_BATCH;
+		for (int i = 0; i != cache->count; ++i) {
+			if (i < batch_count) {
+				batch[i] = cache->pages[i];
+			} else {
+				cache->pages[i - batch_count] = cache->pages[i];
+			}
+		}
+		cache->count -= batch_count;
+	}
+	cache->pages[cache->count++] = pointer;
+	hard_spin_unlock(&caches->lock, rflags);
+	buddy_free_batch(batch, batch_count);
+}
+
+// Caches of all CPUs
+void buddy_drain_caches(void) {
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		struct buddy_cpu_caches* caches = &buddy_allocator.page_caches[cpu];
+		phys_t batch[BUDDY_CACHE_LEVELS][BUDDY_CACHE_SIZE];
+		int batch_count[BUDDY_CACHE_LEVELS];
+		uint64_t rflags = hard_spin_lock(&caches->lock);
+		for (int level = 0; level != BUDDY_CACHE_LEVELS; ++level) {
+			struct buddy_page_cache* cache = &caches->levels[level];
+			batch_count[level] = cache->count;
+			for (int i = 0; i != cache->count; ++i) {
+				batch[level][i] = cache->pages[i];
+			}
+			cache->count = 0;
+		}
+		hard_spin_unlock(&caches->lock, rflags);
+		for (int level = 0; level != BUDDY_CACHE_LEVELS; ++level) {
+			buddy_free_batch(batch[level], batch_count[level]);
+		}
+	}
+}
+
+static phys_t buddy_alloc_try(int level, int zones) {
+	// Cached pages may be from any zone
+	if (level < BUDDY_CACHE_LEVELS && zones == BUDDY_ZONES_ALL) {
+		return buddy_cache_alloc(level);
+	}
+	phys_t res = (phys_t)NULL;
+	buddy_alloc_batch(level, zones, &res, 1);
+	return res;
+}
+
+static void buddy_check_watermark(void) {
+	// Until high memory is freed, there is little free memory anyway
+	if (!buddy_high.is_done) {
+		return;
+	}
+	uint64_t free_pages = 0;
+	for (int zone = 0; zone != BUDDY_ZONES; ++zone) {
+		free_pages += buddy_allocator.zones[zone].free_pages;
+	}
+	if (free_pages < BUDDY_WATERMARK_LOW) {
+		shrinker_wake(BUDDY_WATERMARK_HIGH - free_pages);
+	}
+}
+
+phys_t buddy_alloc_zone(int level, int zones) {
+	phys_t res = buddy_alloc_try(level, zones);
+	if (res == (phys_t)NULL) {
+		// Cached pages may be enough when merged back
+		buddy_drain_caches();
+		res = buddy_alloc_try(level, zones);
+	}
+	// High memory may be not freed yet, don't wait for it
+	while (res == (phys_t)NULL && (zones & (1 << BUDDY_ZONE_NORMAL)) != 0 && buddy_init_high_step()) {
+		res = buddy_alloc_try(level, zones);
+	}
+	// Last chance, caches may give something back
+	while (res == (phys_t)NULL && shrink(1ull << level) != 0) {
+		buddy_drain_caches();
+		res = buddy_alloc_try(level, zones);
+	}
+	if (res != (phys_t)NULL) {
+		buddy_check_watermark();
+	}
+	return res;
+}
+
+phys_t buddy_alloc(int level) {
+	return buddy_alloc_zone(level, BUDDY_ZONES_ALL);
+}
+
+int buddy_alloc_bulk(int level, int count, phys_t* pages) {
+	int allocated = 0;
+	if (level < BUDDY_CACHE_LEVELS) {
+		// Cached pages first, they are hot
+		struct buddy_cpu_caches* caches = buddy_this_caches();
+		uint64_t rflags = hard_spin_lock(&caches->lock);
+		struct buddy_page_cache* cache = &caches->levels[level];
+		while (allocated != count && cache->count != 0) {
+			pages[allocated++] = cache->pages[--cache->count];
+		}
+		hard_spin_unlock(&caches->lock, rflags);
+	}
+	allocated += buddy_alloc_batch(level, BUDDY_ZONES_ALL, pages + allocated, count - allocated);
+	if (allocated != count) {
+		// Zones are short, the rest goes through the slow path with draining & shrinking
+		while (allocated != count) {
+			phys_t page = buddy_alloc(level);
+			if (page == (phys_t)NULL) {
+				break;
+			}
+			pages[allocated++] = page;
+		}
+	} else {
+		buddy_check_watermark();
+	}
+	return allocated;
 }
 
 void buddy_free(phys_t ptr) {
-	mutex_lock(&buddy_allocator.lock);
-	__buddy_free(ptr);
-	mutex_unlock(&buddy_allocator.lock);
+	// Block is ours until freed, so its level can be read without lock
+	int level = buddy_page_get(buddy_page_from_address(ptr))->level;
+	if (level < BUDDY_CACHE_LEVELS) {
+		buddy_cache_free(ptr, level);
+		return;
+	}
+	buddy_free_batch(&ptr, 1);
+}
+
+void buddy_free_bulk(phys_t* pages, int count) {
+	buddy_free_batch(pages, count);
+}
+
+// Free allocated pages [start, end) as largest aligned blocks
+static void __buddy_free_range(struct buddy_zone* zone, buddy_page_no start, buddy_page_no end) {
+	buddy_page_no page = start;
+	while (page < end) {
+		int level = 0;
+		while (
+				level != BUDDY_LEVELS - 1 &&
+				(page & ((2ull << level) - 1)) == 0 &&
+				page + (2ull << level) <= end
+		) {
+			++level;
+		}
+		buddy_page_get(page)->level = level;
+		// Still merges with neighbours, if they are free already
+		__buddy_free(zone, buddy_page_to_address(page));
+		page += 1ull << level;
+	}
+}
+
+void buddy_free_range(phys_t start, phys_t end) {
+	start = ((start + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE; // Align start
+	end = (end / PAGE_SIZE) * PAGE_SIZE;
+	for (int zone_id = 0; zone_id != BUDDY_ZONES; ++zone_id) {
+		struct buddy_zone* zone = &buddy_allocator.zones[zone_id];
+		phys_t zone_start = max_u64(start, zone->start);
+		phys_t zone_end = min_u64(end, zone->end);
+		if (zone_start >= zone_end) {
+			continue;
+		}
+		mutex_lock(&zone->lock);
+		__buddy_free_range(zone, buddy_page_from_address(zone_start), buddy_page_from_address(zone_end));
+		mutex_unlock(&zone->lock);
+	}
+}
+
+// Smallest level that holds count pages
+static int buddy_level_for(uint64_t count) {
+	int level = 0;
+	while ((1ull << level) < count) {
+		++level;
+	}
+	return level;
+}
+
+// Head of an exact block has the level of its leading aligned block, as if it was freed by range and allocated back
+static void buddy_set_head_level(phys_t pointer, uint64_t count) {
+	buddy_page_get(buddy_page_from_address(pointer))->level = 63 - __builtin_clzll(count);
+}
+
+phys_t buddy_alloc_pages(uint64_t count) {
+	int level = buddy_level_for(count);
+	phys_t res = buddy_alloc(level);
+	if (res == (phys_t)NULL || count == (1ull << level)) {
+		return res;
+	}
+	// Tail is not needed, give it back right away
+	buddy_set_head_level(res, count);
+	buddy_free_range(res + count * PAGE_SIZE, res + buddy_size(level));
+	return res;
+}
+
+void buddy_free_pages(phys_t pointer, uint64_t count) {
+	int level = buddy_level_for(count);
+	// Whole block goes through the page cache, the rest is freed by range
+	if (count == (1ull << level)) {
+		buddy_free(pointer);
+	} else {
+		buddy_free_range(pointer, pointer + count * PAGE_SIZE);
+	}
+}
+
+void buddy_trim_pages(phys_t pointer, uint64_t count, uint64_t new_count) {
+	if (new_count < count) {
+		buddy_set_head_level(pointer, new_count);
+		buddy_free_range(pointer + new_count * PAGE_SIZE, pointer + count * PAGE_SIZE);
+	}
+}
+
+void buddy_get_stats(struct buddy_stats* stats) {
+	stats->free_pages = 0;
+	for (int level = 0; level != BUDDY_LEVELS; ++level) {
+		stats->free_count[level] = 0;
+	}
+	for (int zone_id = 0; zone_id != BUDDY_ZONES; ++zone_id) {
+		struct buddy_zone* zone = &buddy_allocator.zones[zone_id];
+		mutex_lock(&zone->lock);
+		stats->zone_free_pages[zone_id] = 0;
+		for (int level = 0; level != BUDDY_LEVELS; ++level) {
+			stats->free_count[level] += zone->free_count[level];
+			stats->zone_free_pages[zone_id] += zone->free_count[level] << level;
+		}
+		stats->free_pages += stats->zone_free_pages[zone_id];
+		mutex_unlock(&zone->lock);
+	}
+	stats->cached_pages = 0;
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		struct buddy_cpu_caches* caches = &buddy_allocator.page_caches[cpu];
+		uint64_t rflags = hard_spin_lock(&caches->lock);
+		for (int level = 0; level != BUDDY_CACHE_LEVELS; ++level) {
+			stats->cached_pages += (uint64_t)caches->levels[level].count << level;
+		}
+		hard_spin_unlock(&caches->lock, rflags);
+	}
 }
 
 struct page_descr* page_descr_for(phys_t ptr) {
-	return &((struct buddy_node*)buddy_node_from_no(buddy_node_from_address(ptr)))->page_descr;
+	buddy_page_no page = buddy_page_from_address(ptr);
+	return &buddy_section_get(page)->page_descrs[page & (BUDDY_SECTION_PAGES - 1)];
 }
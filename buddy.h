@@ -3,38 +3,124 @@
 #include "memory.h"
 #include "page_descr.h"
 #include "threads.h"
+#include "list.h"
+#include "spinlock.h"
+#include "cpu.h"
 #include <stddef.h>
 
 #define BUDDY_LEVELS 21
 #define BUDDY_MAX_NODE_LENGTH (PAGE_LENGTH * (1 << (BUDDY_LEVELS - 1)))
 
-// Order:
-// -BUDDY_LEVELS        -- NULL
-// -BUDDY_LEVELS+1 - -1 -- LIST STARTS
-//               0 -    -- real nodes
-#define BUDDY_NODE_NULL  (-BUDDY_LEVELS)
-#define BUDDY_NODE_START (-BUDDY_LEVELS+1)
-typedef int32_t buddy_node_no;
+typedef uint64_t buddy_page_no;
 
-struct buddy_node {
+// Buddy state of one page, only meaningful for the first page of a block.
+// Free list links live in free blocks themselves, so this is all buddy keeps per page.
+struct buddy_page {
 	uint8_t level:7;
 	uint8_t is_free:1;
-	buddy_node_no prev;
-	buddy_node_no next;
-	struct page_descr page_descr;
 };
 
-struct buddy_allocator {
+// Sparse memory: page metadata is allocated by sections,
+// only for sections that have some available memory.
+#define BUDDY_SECTION_BITS  15
+#define BUDDY_SECTION_PAGES (1ull << BUDDY_SECTION_BITS)
+
+struct buddy_section {
+	// Both NULL if section has no available memory
+	struct buddy_page* pages;
+	// Kept in separate array, so page_descr_for touches only these
+	struct page_descr* page_descrs;
+	// Metadata is filled, sections above BOOTMEM_SIZE get it with their chunk
+	bool is_ready;
+};
+
+// Zones, allocation falls back from higher to lower ones
+enum buddy_zone_id {
+	BUDDY_ZONE_LOW,    // Below 16 MiB, legacy DMA
+	BUDDY_ZONE_DMA32,  // Below 4 GiB, 32-bit DMA
+	BUDDY_ZONE_NORMAL, // Everything else
+	BUDDY_ZONES
+};
+
+#define BUDDY_ZONE_LOW_END   (16ull * 1024ull * 1024ull)
+#define BUDDY_ZONE_DMA32_END (4ull * 1024ull * 1024ull * 1024ull)
+
+// Zone masks for buddy_alloc_zone
+#define BUDDY_ZONES_LOW   (1 << BUDDY_ZONE_LOW)
+#define BUDDY_ZONES_DMA32 (BUDDY_ZONES_LOW | (1 << BUDDY_ZONE_DMA32))
+#define BUDDY_ZONES_ALL   ((1 << BUDDY_ZONES) - 1)
+
+struct buddy_zone {
 	struct mutex lock;
-	struct buddy_node node_list_starts[BUDDY_LEVELS];
-	buddy_node_no nodes_count;
-	struct buddy_node* nodes;
+	const char* name;
+	phys_t start;
+	phys_t end;
+	struct list_node free_lists[BUDDY_LEVELS];
+	// Bit N is set iff list of level N is not empty
+	uint32_t free_levels;
+	// Number of free blocks on each level
+	uint64_t free_count[BUDDY_LEVELS];
+	uint64_t free_pages;
+};
+
+// Shrinkers are woken below low watermark to free memory up to high one, in pages
+#define BUDDY_WATERMARK_LOW  1024
+#define BUDDY_WATERMARK_HIGH 4096
+
+// Per-CPU cache of small blocks, see buddy_alloc
+// Levels 0 (pages) and 1 (thread stacks) are cached
+#define BUDDY_CACHE_LEVELS 2
+#define BUDDY_CACHE_SIZE   32
+#define BUDDY_CACHE_BATCH  8
+
+struct buddy_page_cache {
+	int count;
+	phys_t pages[BUDDY_CACHE_SIZE];
+};
+
+struct buddy_cpu_caches {
+	// Taken by others only to drain or count
+	struct spinlock lock;
+	struct buddy_page_cache levels[BUDDY_CACHE_LEVELS];
+};
+
+struct buddy_allocator {
+	struct buddy_zone zones[BUDDY_ZONES];
+	buddy_page_no pages_count;
+	uint64_t sections_count;
+	struct buddy_section* sections;
+	// Indexed by CPU id
+	struct buddy_cpu_caches page_caches[CPU_MAX];
+};
+
+struct buddy_stats {
+	uint64_t free_count[BUDDY_LEVELS];
+	uint64_t zone_free_pages[BUDDY_ZONES];
+	uint64_t free_pages;
+	uint64_t cached_pages;
 };
 
 void buddy_init(void);
+// Starts freeing memory above BOOTMEM_SIZE in background, needs scheduler
 void buddy_init_high(void);
+// Waits for that background thread and frees it
+void buddy_init_high_join(void);
 phys_t buddy_alloc(int level);
+phys_t buddy_alloc_zone(int level, int zones);
 void buddy_free(phys_t pointer);
+// Up to count blocks of a level, taking each lock once. Returns how many were allocated.
+int buddy_alloc_bulk(int level, int count, phys_t* pages);
+// Blocks go straight to zones, bypassing page cache
+void buddy_free_bulk(phys_t* pages, int count);
+void buddy_free_range(phys_t start, phys_t end);
+// Exactly count contiguous pages, the rest of the block is returned to buddy
+phys_t buddy_alloc_pages(uint64_t count);
+void buddy_free_pages(phys_t pointer, uint64_t count);
+// Keeps the first count pages of those, gives back the rest
+void buddy_trim_pages(phys_t pointer, uint64_t count, uint64_t new_count);
+// Return pages kept in page caches to the zones
+void buddy_drain_caches(void);
+void buddy_get_stats(struct buddy_stats* stats);
 
 struct page_descr* page_descr_for(phys_t ptr);
 
@@ -3,6 +3,10 @@
 #include "memory.h"
 #include "log.h"
 #include "string.h"
+#include "threads.h"
+#include "pit.h"
+#include "smp.h"
+#include "slab-allocator.h"
 
 static int read_arg_num(const char **s) {
 	int arg = 0;
@@ -52,6 +56,32 @@ void read_cmdline(void) {
 			int flag = read_arg_num(&s);
 			log(LEVEL_INFO, "Log coloring %sabled.", flag ? "en" : "dis");
 			log_set_color_enabled(flag);
+		} else if (strncmp(s, "sched=", 6) == 0) {
+			s += 6;
+			char class[10];
+			read_arg_str(&s, class, 10);
+			if (strcmp(class, "cfs") == 0) {
+				scheduler_set_class(SCHEDULER_FAIR);
+			} else if (strcmp(class, "rr") == 0) {
+				scheduler_set_class(SCHEDULER_RR);
+			} else {
+				log(LEVEL_WARN, "Unknown scheduler \"%s\", use cfs or rr.", class);
+			}
+		} else if (strncmp(s, "tickless=", 9) == 0) {
+			s += 9;
+			int flag = read_arg_num(&s);
+			log(LEVEL_INFO, "Tickless idle %sabled.", flag ? "en" : "dis");
+			pit_set_tickless(flag);
+		} else if (strncmp(s, "smp=", 4) == 0) {
+			s += 4;
+			int flag = read_arg_num(&s);
+			log(LEVEL_INFO, "SMP %sabled.", flag ? "en" : "dis");
+			smp_set_enabled(flag);
+		} else if (strncmp(s, "slab_color=", 11) == 0) {
+			s += 11;
+			int flag = read_arg_num(&s);
+			log(LEVEL_INFO, "Slab coloring %sabled.", flag ? "en" : "dis");
+			slab_set_coloring(flag);
 		} else {
 			log(LEVEL_WARN, "Error in cmdline");
 			return;
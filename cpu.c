@@ -0,0 +1,100 @@
+#include "cpu.h"
+#include "memory.h"
+#include "log.h"
+#include <stddef.h>
+
+static struct cpu cpus[CPU_MAX];
+static int cpus_count = 0;
+
+// The same descriptors as bootstrap GDT has
+static const uint64_t cpu_gdt[] = {
+	0x0000000000000000,
+	0x00cf9a000000ffff,
+	0x00cf92000000ffff,
+	0x00a09a0000000000,
+	0x00a0920000000000,
+	0x00a0fa0000000000,
+	0x00a0f20000000000
+};
+
+struct gdt_ptr {
+	uint16_t size;
+	uint64_t base;
+} __attribute__((packed));
+
+int cpu_current_id(void) {
+	return cpu_current()->id;
+}
+
+static struct cpu* cpu_new(uint32_t apic_id) {
+	if (cpus_count == CPU_MAX) {
+		return NULL;
+	}
+	struct cpu* cpu = &cpus[cpus_count];
+	cpu->self = cpu;
+	cpu->id = cpus_count++;
+	cpu->apic_id = apic_id;
+	cpu->is_online = false;
+	cpu->lock_depth = 0;
+	cpu->quantum_ticks = 0;
+	return cpu;
+}
+
+// Available 64-bit TSS takes two entries
+static void cpu_set_tss(struct cpu* cpu) {
+	uint64_t base = (uint64_t)&cpu->tss;
+	uint64_t limit = sizeof(cpu->tss) - 1;
+	cpu->tss.iomap_base = sizeof(cpu->tss);
+	cpu->tss.ist[CPU_FAULT_IST - 1] = (uint64_t)cpu->fault_stack + CPU_FAULT_STACK_SIZE;
+	cpu->gdt[CPU_TSS / 8] = get_bits(limit, 0, 16) | (get_bits(base, 0, 24) << 16) | (0x89ull << 40)
+			| (get_bits(limit, 16, 4) << 48) | (get_bits(base, 24, 8) << 56);
+	cpu->gdt[CPU_TSS / 8 + 1] = get_bits(base, 32, 32);
+}
+
+void cpu_init(struct cpu* cpu) {
+	for (unsigned i = 0; i != sizeof(cpu_gdt) / sizeof(cpu_gdt[0]); ++i) {
+		cpu->gdt[i] = cpu_gdt[i];
+	}
+	cpu_set_tss(cpu);
+
+	struct gdt_ptr ptr;
+	ptr.size = sizeof(cpu->gdt) - 1;
+	ptr.base = (uint64_t)cpu->gdt;
+	asm volatile ("lgdt %0" : : "m"(ptr));
+	// Far return reloads CS
+	asm volatile (
+		"pushq %0\n"
+		"leaq 1f(%%rip), %%rax\n"
+		"pushq %%rax\n"
+		"lretq\n"
+		"1:\n"
+		"movw %w1, %%ds\n"
+		"movw %w1, %%es\n"
+		"movw %w1, %%ss\n"
+		: : "i"(KERNEL_CODE), "r"(KERNEL_DATA) : "rax", "memory");
+	asm volatile ("ltr %w0" : : "r"(CPU_TSS));
+	wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
+
+void cpu_init_bsp(void) {
+	// APIC ID is filled by SMP init, it needs LAPIC mapped
+	struct cpu* cpu = cpu_new(0);
+	cpu_init(cpu);
+	cpu->is_online = true;
+}
+
+struct cpu* cpu_add(uint32_t apic_id) {
+	return cpu_new(apic_id);
+}
+
+struct cpu* cpu_get(int id) {
+	return &cpus[id];
+}
+
+int cpu_count(void) {
+	int count = 0;
+	for (int id = 0; id != cpus_count; ++id) {
+		count += cpus[id].is_online;
+	}
+	return count;
+}
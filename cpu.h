@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CPU_MAX 8
+
+// Bootstrap GDT layout, and TSS after it
+#define CPU_GDT_ENTRIES 9
+#define CPU_TSS         0x38
+
+#define MSR_GS_BASE 0xC0000101
+
+// Stack for double fault, so it works even when thread's one is broken
+#define CPU_FAULT_STACK_SIZE 0x1000
+#define CPU_FAULT_IST        1
+
+struct tss {
+	uint32_t reserved0;
+	uint64_t rsp[3];
+	uint64_t reserved1;
+	uint64_t ist[7];
+	uint64_t reserved2;
+	uint16_t reserved3;
+	uint16_t iomap_base;
+} __attribute__((packed));
+
+struct cpu {
+	// Must be the first, cpu_current reads it through GS
+	struct cpu* self;
+	int id;
+	uint32_t apic_id;
+	volatile bool is_online;
+	// hard_lock nesting on this CPU
+	int lock_depth;
+	// Timer ticks since the last quantum end
+	int quantum_ticks;
+	uint64_t gdt[CPU_GDT_ENTRIES];
+	struct tss tss;
+	uint8_t fault_stack[CPU_FAULT_STACK_SIZE] __attribute__((aligned(16)));
+};
+
+// Called first in main, BSP becomes CPU 0
+void cpu_init_bsp(void);
+// Loads GDT, TSS & GS base of that CPU, on it
+void cpu_init(struct cpu* cpu);
+// Next free slot for an application processor, NULL if there are CPU_MAX already
+struct cpu* cpu_add(uint32_t apic_id);
+struct cpu* cpu_get(int id);
+// Ones that are started (BSP too), others have not come up yet or failed to
+int cpu_count(void);
+
+// Per-CPU data indexed by it needs its own lock, the thread may move to another CPU right after
+int cpu_current_id(void);
+
+static inline struct cpu* cpu_current(void) {
+	struct cpu* cpu;
+	asm volatile ("movq %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+	asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
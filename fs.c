@@ -11,31 +11,54 @@ static struct slab_allocator file_desc_allocator;
 static struct slab_allocator dir_desc_allocator;
 static struct file root;
 
-static bool file_resize(struct file* file, uint64_t new_size_level) {
-	phys_t new_phys = buddy_alloc(new_size_level);
-	if (new_phys == (uint64_t) NULL) {
-		log(LEVEL_ERROR, "Cannot resize file @%p (level %d -> %d): no memory!", file, file->size_level, new_size_level);
-		return false;
+// Dir entries taken in bulk before creating many files, linked through their own links
+#define FS_RESERVE_BATCH 64
+static struct {
+	struct mutex lock;
+	struct list_node entries;
+} reserve;
+
+static bool file_resize(struct file* file, uint64_t new_pages) {
+	char* new_data = NULL;
+	if (new_pages != 0) {
+		phys_t new_phys = buddy_alloc_pages(new_pages);
+		if (new_phys == (uint64_t) NULL) {
+			log(LEVEL_ERROR, "Cannot resize file @%p (%llu -> %llu pages): no memory!", file, file->pages, new_pages);
+			return false;
+		}
+		new_data = (char*) va(new_phys);
 	}
-	char* new_data = (char*) va(new_phys);
-	if (file->size_level != -1) {
-		memcpy(new_data, file->data, buddy_size(min(file->size_level, new_size_level)));
-		buddy_free(pa(file->data));
+	if (file->pages != 0) {
+		memcpy(new_data, file->data, min_u64(file->pages, new_pages) * PAGE_SIZE);
+		buddy_free_pages(pa(file->data), file->pages);
 	}
 	file->data = new_data;
-	file->size_level = new_size_level;
+	file->pages = new_pages;
 	return true;
 }
 
-static bool file_init(struct file* file, enum file_type file_type) {
-	mutex_init(&file->lock);
+// Capacity only doubles on writes, so appends copy file data O(1) times per byte.
+// Exact size is restored by trimming, when the file is done with.
+static void file_trim(struct file* file) {
+	uint64_t pages = (file->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (pages == 0) {
+		file_resize(file, 0);
+	} else if (pages < file->pages) {
+		buddy_trim_pages(pa(file->data), file->pages, pages);
+		file->pages = pages;
+	}
+}
+
+// Lock is not touched, dir entries have it constructed by slab
+static bool file_init_type(struct file* file, enum file_type file_type) {
 	file->type = file_type;
 	switch (file_type) {
 		case T_REGULAR:
-			file->size_level = -1;
+			file->pages = 0;
 			file->size = 0;
 			file->data = NULL;
-			return file_resize(file, 0);
+			file->generator = NULL;
+			return true;
 		case T_DIRECTORY:
 			list_init(&file->entries_head);
 			return true;
@@ -45,22 +68,98 @@ static bool file_init(struct file* file, enum file_type file_type) {
 	}
 }
 
-static bool dir_entry_init(struct dir_entry* entry, const char* filename, enum file_type type) {
+static bool file_init(struct file* file, enum file_type file_type) {
+	mutex_init(&file->lock);
+	return file_init_type(file, file_type);
+}
+
+static void dir_entry_ctor(struct dir_entry* entry) {
 	list_init(&entry->link);
+	mutex_init(&entry->file.lock);
+}
+
+static void dir_entry_dtor(struct dir_entry* entry) {
+	mutex_finit(&entry->file.lock);
+}
+
+static bool dir_entry_init(struct dir_entry* entry, const char* filename, enum file_type type) {
 	strncpy(entry->name, filename, FILE_NAME);
-	bool result = file_init(&entry->file, type);
+	bool result = file_init_type(&entry->file, type);
 	if (!result) {
 		log(LEVEL_ERROR, "Failed initialising file %s.", filename);
 	}
 	return result;
 }
 
+// Reserved one if there is, slab is the fallback
+static struct dir_entry* dir_entry_alloc(void) {
+	struct dir_entry* entry = NULL;
+	mutex_lock(&reserve.lock);
+	if (!list_empty(&reserve.entries)) {
+		struct list_node* node = list_first(&reserve.entries);
+		list_delete(node);
+		entry = LIST_ENTRY(node, struct dir_entry, link);
+	}
+	mutex_unlock(&reserve.lock);
+	return entry != NULL ? entry : (struct dir_entry*) slab_alloc(&dir_entry_allocator);
+}
+
+void fs_reserve_entries(int count) {
+	void* entries[FS_RESERVE_BATCH];
+	while (count > 0) {
+		int allocated = slab_alloc_bulk(&dir_entry_allocator, min(count, FS_RESERVE_BATCH), entries);
+		if (allocated == 0) {
+			// Creating files will try again one by one
+			return;
+		}
+		mutex_lock(&reserve.lock);
+		for (int i = 0; i != allocated; ++i) {
+			list_add(&((struct dir_entry*) entries[i])->link, &reserve.entries);
+		}
+		mutex_unlock(&reserve.lock);
+		count -= allocated;
+	}
+}
+
+void fs_release_entries(void) {
+	void* entries[FS_RESERVE_BATCH];
+	int count;
+	do {
+		count = 0;
+		mutex_lock(&reserve.lock);
+		while (count != FS_RESERVE_BATCH && !list_empty(&reserve.entries)) {
+			struct list_node* node = list_first(&reserve.entries);
+			list_delete(node);
+			entries[count++] = LIST_ENTRY(node, struct dir_entry, link);
+		}
+		mutex_unlock(&reserve.lock);
+		if (count != 0) {
+			slab_free_bulk(&dir_entry_allocator, count, entries);
+		}
+	} while (count == FS_RESERVE_BATCH);
+}
+
+static void slabinfo_write_line(const char* line, void* data) {
+	struct file_desc* fd = (struct file_desc*) data;
+	write(fd, line, strlen(line));
+	write(fd, "\n", 1);
+}
+
+static void slabinfo_generate(struct file_desc* fd) {
+	slabinfo_report(slabinfo_write_line, fd);
+}
+
 void fs_init(void) {
-	slab_init_for(&dir_entry_allocator, struct dir_entry);
+	slab_init_ctor_for(&dir_entry_allocator, struct dir_entry, (slab_ctor_t)dir_entry_ctor, (slab_dtor_t)dir_entry_dtor);
 	slab_init_for(&file_desc_allocator, struct file_desc);
 	slab_init_for(&dir_desc_allocator, struct directory_desc);
+	mutex_init(&reserve.lock);
+	list_init(&reserve.entries);
 
 	file_init(&root, T_DIRECTORY);
+
+	mkdir("/proc");
+	create_generated("/proc/slabinfo", slabinfo_generate);
 }
 
 static struct file* path_step(struct file* dir, const char* pathname) {
@@ -121,7 +220,7 @@ static struct file* file_open(const char* pathname, enum file_type type, int fla
 		}
 	}
 	// Create new one
-	struct dir_entry* dir_entry = (struct dir_entry*) slab_alloc(&dir_entry_allocator);
+	struct dir_entry* dir_entry = dir_entry_alloc();
 	if (dir_entry == NULL) {
 		log(LEVEL_ERROR, "No memory to create new dir entry.");
 		mutex_unlock(&dir->lock);
@@ -149,12 +248,20 @@ struct file_desc* open(const char* pathname, int flags) {
 	}
 	mutex_lock(&file->lock);
 	file_desc->file = file;
-	if (flags & O_TRUNCATE) {
+	if ((flags & O_TRUNCATE) || file->generator != NULL) {
 		file_resize(file, 0);
 		file->size = 0;
 	}
 	file_desc->pos = (flags & O_APPEND) ? file->size : 0;
 	mutex_unlock(&file->lock);
+	if (file->generator != NULL) {
+		// Concurrent opens of the same file would mix their contents, fine for reports
+		file->generator(file_desc);
+		file_desc->pos = 0;
+		mutex_lock(&file->lock);
+		file_trim(file);
+		mutex_unlock(&file->lock);
+	}
 
 	return file_desc;
 }
@@ -173,16 +280,18 @@ uint64_t read(struct file_desc* fd, char* buffer, uint64_t size) {
 
 uint64_t write(struct file_desc* fd, const char* buffer, uint64_t size) {
 	mutex_lock(&fd->file->lock);
-	while (fd->pos + size > buddy_size(fd->file->size_level) && fd->file->size_level < BUDDY_LEVELS - 1) {
-		//Try to relocate...
-		if (!file_resize(fd->file, fd->file->size_level + 1)) {
+	uint64_t new_pages = (fd->pos + size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (new_pages > fd->file->pages) {
+		//Try to relocate... Empty file gets exactly what is written at once.
+		uint64_t doubled = max_u64(new_pages, fd->file->pages * 2);
+		if (!file_resize(fd->file, doubled) && (doubled == new_pages || !file_resize(fd->file, new_pages))) {
 			log(LEVEL_WARN, "Failed to increment file size.");
-			break;
 		}
 	}
+	uint64_t capacity = fd->file->pages * PAGE_SIZE;
 	uint64_t amount = 0;
-	if (fd->pos < buddy_size(fd->file->size_level)) {
-		amount = min_u64(size, buddy_size(fd->file->size_level) - fd->pos);
+	if (fd->pos < capacity) {
+		amount = min_u64(size, capacity - fd->pos);
 	}
 	memcpy(fd->file->data + fd->pos, buffer, amount);
 	fd->pos += amount;
@@ -192,9 +301,23 @@ uint64_t write(struct file_desc* fd, const char* buffer, uint64_t size) {
 }
 
 void close(struct file_desc* file) {
+	mutex_lock(&file->file->lock);
+	file_trim(file->file);
+	mutex_unlock(&file->file->lock);
 	slab_free(file);
 }
 
+bool create_generated(const char* pathname, file_generator_t generator) {
+	struct file* file = file_open(pathname, T_REGULAR, O_CREAT);
+	if (file == NULL) {
+		return false;
+	}
+	mutex_lock(&file->lock);
+	file->generator = generator;
+	mutex_unlock(&file->lock);
+	return true;
+}
+
 bool mkdir(const char* pathname) {
 	struct file* dir = file_open(pathname, T_DIRECTORY, 0);
 	if (dir) {
@@ -240,7 +363,7 @@ void closedir(struct directory_desc* dir_desc) {
 static void __ls(struct file* file, int offset) {
 	mutex_lock(&file->lock);
 	if (file->type == T_REGULAR) {
-		printf("regular size=%llu level=%d data@%p.\n", file->size, file->size_level, file->data);
+		printf("regular size=%llu pages=%llu data@%p.\n", file->size, file->pages, file->data);
 	} else {
 		printf("directory.\n");
 		for (
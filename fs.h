@@ -11,13 +11,19 @@ enum file_type {
 	T_DIRECTORY
 };
 
+struct file_desc;
+
+// Writes contents of a generated file, it is called on each open
+typedef void (*file_generator_t)(struct file_desc* fd);
+
 struct file {
 	struct mutex lock;
 	enum file_type type;
 	// for regular
 	uint64_t size;
-	int size_level;
+	uint64_t pages;
 	char* data;
+	file_generator_t generator;
 	// for directory
 	struct list_node entries_head;
 };
@@ -45,11 +51,16 @@ enum file_flags {
 };
 
 void fs_init(void);
+// Dir entries for that many files to be created, taken from slab at once. Unused ones are given back by release.
+void fs_reserve_entries(int count);
+void fs_release_entries(void);
 
 struct file_desc* open(const char* pathname, int mode);
 uint64_t read(struct file_desc* fd, char* buffer, uint64_t size);
 uint64_t write(struct file_desc* fd, const char* buffer, uint64_t size);
 void close(struct file_desc* file);
+// Regular file made anew on each open, i.e. a report
+bool create_generated(const char* pathname, file_generator_t generator);
 
 bool mkdir(const char* pathname);
 struct directory_desc* opendir(const char* pathname);
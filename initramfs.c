@@ -21,6 +21,22 @@ static uint64_t parse(void* p, int size) {
 	return res;
 }
 
+// Nodes but the root and the end marker, each needs a dir entry
+static int __count(struct cpio_header* header, void* end) {
+	int count = 0;
+	while (header + 1 <= (struct cpio_header*) end) {
+		uint64_t name_len = parse(&header->namesize, 8);
+		uint64_t file_len = parse(&header->filesize, 8);
+		char* name = (char*)header + sizeof(struct cpio_header);
+		if (strncmp(name, CPIO_END_OF_ARCHIVE, strlen(CPIO_END_OF_ARCHIVE) + 1) == 0) {
+			break;
+		}
+		count += strncmp(name, ".", 2) != 0;
+		header = (struct cpio_header*) adjust(adjust(header, sizeof(struct cpio_header) + name_len), file_len);
+	}
+	return count;
+}
+
 static void __load(struct cpio_header* header, void* end) {
 	while (header + 1 <= (struct cpio_header*) end) {
 		int mode = parse(&header->mode, 8);
@@ -76,6 +92,8 @@ void initramfs_load(void) {
 			continue;
 		}
 		log(LEVEL_INFO, "Found initramfs as mod#%u (%s).", i, mods[i].string == 0 ? "<null>" : va(mods[i].string));
+		fs_reserve_entries(__count(header, va(mods[i].mod_end)));
 		__load(header, va(mods[i].mod_end));
+		fs_release_entries();
 	}
 }
@@ -2,6 +2,7 @@
 #include "memory.h"
 #include "log.h"
 #include "threads.h"
+#include "cpu.h"
 
 #include <stddef.h>
 
@@ -26,6 +27,8 @@ void interrupt_init(void) {
 		interrupt->flags = INTERRUPT_FLAG_INT64 | INTERRUPT_FLAG_PRESENT;
 		interrupt->reserved = 0;
 	}
+	// Double fault has a stack of its own in TSS
+	idt[8].ist = CPU_FAULT_IST;
 	interrupt_set_idt(&idt_ptr);
 
 	interrupt_set(6 , interrupt_handler_halt);
@@ -34,6 +37,10 @@ void interrupt_init(void) {
 	interrupt_set(14, interrupt_handler_halt);
 }
 
+void interrupt_load(void) {
+	interrupt_set_idt(&idt_ptr);
+}
+
 static interrupt_handler_t handlers[INTERRUPT_COUNT];
 
 void interrupt_set(uint8_t id, interrupt_handler_t handler) {
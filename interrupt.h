@@ -7,6 +7,11 @@
 
 #define INTERRUPT_PIT ((uint8_t)INTERRUPT_PIC_MASTER + 0)
 
+// Local APIC ones, each CPU has its own
+#define INTERRUPT_LAPIC_TIMER 0x30
+#define INTERRUPT_RESCHEDULE  0x31
+#define INTERRUPT_SPURIOUS    0xFF
+
 #ifndef __ASM_FILE__
 
 #include <stdint.h>
@@ -38,6 +43,8 @@ typedef void (*interrupt_handler_wrapper_t)(void);
 typedef void (*interrupt_handler_t)(struct interrupt_info* info);
 
 void interrupt_init(void);
+// The same IDT on other CPUs
+void interrupt_load(void);
 void interrupt_set(uint8_t id, interrupt_handler_t handler);
 void interrupt_handler_halt(struct interrupt_info* info);
 
@@ -5,5 +5,5 @@
 
 #define SERIAL_DIVISOR 0x0001u /* Serial port freq divisor */
 
-#define PIT_DIVISOR  40000u     /* PIT freq divisor */
-#define PIT_TICKS    3          /* PIT ticks for actions */
+#define PIT_DIVISOR  1193u      /* PIT freq divisor, about 1 kHz */
+#define PIT_TICKS    100        /* PIT ticks for actions */
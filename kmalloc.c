@@ -0,0 +1,117 @@
+#include "kmalloc.h"
+#include "slab-allocator.h"
+#include "buddy.h"
+#include "string.h"
+#include "log.h"
+
+// Powers of two and 1.5x steps between them
+static const uint16_t kmalloc_sizes[] = {
+	8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+static const char* kmalloc_names[] = {
+	"kmalloc-8", "kmalloc-16", "kmalloc-24", "kmalloc-32", "kmalloc-48", "kmalloc-64", "kmalloc-96", "kmalloc-128",
+	"kmalloc-192", "kmalloc-256", "kmalloc-384", "kmalloc-512", "kmalloc-768", "kmalloc-1024", "kmalloc-1536", "kmalloc-2048"
+};
+
+#define KMALLOC_CLASSES (sizeof(kmalloc_sizes) / sizeof(kmalloc_sizes[0]))
+
+static struct slab_allocator kmalloc_allocators[KMALLOC_CLASSES];
+
+void kmalloc_init(void) {
+	for (unsigned i = 0; i != KMALLOC_CLASSES; ++i) {
+		slab_init(&kmalloc_allocators[i], kmalloc_names[i], kmalloc_sizes[i], 8);
+	}
+}
+
+static int kmalloc_class_for(size_t size) {
+	// Binary search for the smallest class that fits
+	int l = -1;
+	int r = KMALLOC_CLASSES - 1;
+	while (r - l > 1) {
+		int m = (l + r) / 2;
+		if (kmalloc_sizes[m] >= size) {
+			r = m;
+		} else {
+			l = m;
+		}
+	}
+	return r;
+}
+
+static void* kmalloc_big(size_t size) {
+	uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	phys_t phys = buddy_alloc_pages(pages);
+	if (phys == (phys_t)NULL) {
+		return NULL;
+	}
+	page_descr_for(phys)->kmalloc_pages = (pages << 1) | 1;
+	return va(phys);
+}
+
+void* kmalloc(size_t size, int flags) {
+	if (size == 0) {
+		return NULL;
+	}
+	void* ptr;
+	if (size <= KMALLOC_MAX_CLASS) {
+		ptr = slab_alloc(&kmalloc_allocators[kmalloc_class_for(size)]);
+	} else {
+		ptr = kmalloc_big(size);
+	}
+	if (ptr == NULL) {
+		log(LEVEL_WARN, "kmalloc(%llu) failed: no memory.", (uint64_t)size);
+		return NULL;
+	}
+	if (flags & KMALLOC_ZERO) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+size_t ksize(void* ptr) {
+	if (ptr == NULL) {
+		return 0;
+	}
+	struct page_descr* page_descr = page_descr_for(pa(ptr));
+	if (page_descr_is_kmalloc(page_descr)) {
+		return (page_descr->kmalloc_pages >> 1) * PAGE_SIZE;
+	}
+	return page_descr->slab->allocator->obj_size;
+}
+
+void kfree(void* ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	phys_t phys = pa(ptr);
+	struct page_descr* page_descr = page_descr_for(phys);
+	if (page_descr_is_kmalloc(page_descr)) {
+		uint64_t pages = page_descr->kmalloc_pages >> 1;
+		page_descr_init(page_descr);
+		buddy_free_pages(phys, pages);
+		return;
+	}
+	slab_free(ptr);
+}
+
+void* krealloc(void* ptr, size_t size, int flags) {
+	if (ptr == NULL) {
+		return kmalloc(size, flags);
+	}
+	if (size == 0) {
+		kfree(ptr);
+		return NULL;
+	}
+	size_t old_size = ksize(ptr);
+	if (size <= old_size) {
+		return ptr;
+	}
+	void* new_ptr = kmalloc(size, flags);
+	if (new_ptr == NULL) {
+		return NULL;
+	}
+	memcpy(new_ptr, ptr, old_size);
+	kfree(ptr);
+	return new_ptr;
+}
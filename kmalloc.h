@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sizes up to that come from size class slabs, bigger ones are whole pages from buddy
+#define KMALLOC_MAX_CLASS 2048
+
+enum kmalloc_flags {
+	KMALLOC_ZERO = 1 << 0 // Fill memory with zeroes
+};
+
+void kmalloc_init(void);
+
+void* kmalloc(size_t size, int flags);
+void kfree(void* ptr);
+// Keeps the block if its size class is enough for new size. KMALLOC_ZERO clears memory past ksize(ptr).
+void* krealloc(void* ptr, size_t size, int flags);
+// How many bytes can be used in that block
+size_t ksize(void* ptr);
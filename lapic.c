@@ -0,0 +1,111 @@
+#include "lapic.h"
+#include "interrupt.h"
+#include "paging.h"
+#include "kernel_config.h"
+#include "threads.h"
+#include "timer.h"
+#include "cpu.h"
+#include "log.h"
+
+static volatile uint8_t* lapic_base;
+static uint32_t lapic_timer_count;
+
+static inline uint32_t lapic_read(int reg) {
+	return *(volatile uint32_t*)(lapic_base + reg);
+}
+
+static inline void lapic_write(int reg, uint32_t value) {
+	*(volatile uint32_t*)(lapic_base + reg) = value;
+}
+
+static void lapic_timer_handler(struct interrupt_info* info) {
+	lapic_eoi();
+	struct cpu* cpu = cpu_current();
+	// The same as PIT does on BSP
+	bool should_schedule = false;
+	if (++cpu->quantum_ticks >= PIT_TICKS || thread_current()->is_idle) {
+		cpu->quantum_ticks = 0;
+		should_schedule = !scheduler_is_alone();
+	}
+	if (should_schedule) {
+		schedule(THREAD_NEW_STATE_ALIVE);
+	}
+}
+
+// Some thread was woken for this CPU
+static void lapic_reschedule_handler(struct interrupt_info* info) {
+	lapic_eoi();
+	schedule(THREAD_NEW_STATE_ALIVE);
+}
+
+static void lapic_spurious_handler(struct interrupt_info* info) {
+	// No EOI for these
+}
+
+void lapic_init(phys_t base) {
+	paging_map_io(base, LAPIC_SIZE);
+	lapic_base = va(base);
+	interrupt_set(INTERRUPT_LAPIC_TIMER, lapic_timer_handler);
+	interrupt_set(INTERRUPT_RESCHEDULE, lapic_reschedule_handler);
+	interrupt_set(INTERRUPT_SPURIOUS, lapic_spurious_handler);
+}
+
+void lapic_enable(void) {
+	// LINT0 stays as firmware left it, BSP gets PIC through it
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | INTERRUPT_SPURIOUS);
+	lapic_write(LAPIC_ESR, 0);
+}
+
+uint32_t lapic_id(void) {
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+	lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_send(uint32_t apic_id, uint32_t command) {
+	lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, command);
+	while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+		asm volatile ("pause");
+	}
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+	lapic_send(apic_id, LAPIC_ICR_FIXED | LAPIC_ICR_ASSERT | vector);
+}
+
+void lapic_send_init(uint32_t apic_id) {
+	lapic_send(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+}
+
+void lapic_send_startup(uint32_t apic_id, phys_t page) {
+	lapic_send(apic_id, LAPIC_ICR_STARTUP | (page >> PAGE_BITS));
+}
+
+static void lapic_wait_tick(uint64_t tick) {
+	while (timer_ticks() < tick) {
+		hlt();
+	}
+}
+
+void lapic_timer_calibrate(void) {
+	lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | INTERRUPT_LAPIC_TIMER);
+	// From a tick edge, so whole ticks are counted
+	lapic_wait_tick(timer_ticks() + 1);
+	uint64_t start = timer_ticks();
+	lapic_write(LAPIC_TIMER_INITIAL, 0xffffffffu);
+	lapic_wait_tick(start + LAPIC_CALIBRATE_TICKS);
+	uint32_t passed = 0xffffffffu - lapic_read(LAPIC_TIMER_CURRENT);
+	lapic_write(LAPIC_TIMER_INITIAL, 0);
+	lapic_timer_count = passed / (timer_ticks() - start);
+	log(LEVEL_INFO, "LAPIC timer: %u counts per tick.", lapic_timer_count);
+}
+
+void lapic_timer_start(void) {
+	lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | INTERRUPT_LAPIC_TIMER);
+	lapic_write(LAPIC_TIMER_INITIAL, lapic_timer_count);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "memory.h"
+#include <stdint.h>
+
+// Registers, offsets in LAPIC page
+#define LAPIC_ID            0x020
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ESR           0x280
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SIZE 0x1000
+
+#define LAPIC_SVR_ENABLE       (1 << 8)
+#define LAPIC_ICR_FIXED        (0 << 8)
+#define LAPIC_ICR_INIT         (5 << 8)
+#define LAPIC_ICR_STARTUP      (6 << 8)
+#define LAPIC_ICR_PENDING      (1 << 12)
+#define LAPIC_ICR_ASSERT       (1 << 14)
+#define LAPIC_LVT_MASKED       (1 << 16)
+#define LAPIC_TIMER_PERIODIC   (1 << 17)
+#define LAPIC_TIMER_DIVIDE_16  0x3
+
+// PIT ticks to measure LAPIC timer against
+#define LAPIC_CALIBRATE_TICKS 20
+
+// BSP maps LAPIC registers, they are at the same address on every CPU
+void lapic_init(phys_t base);
+// On the calling CPU
+void lapic_enable(void);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+void lapic_send_init(uint32_t apic_id);
+// AP starts in real mode at that page
+void lapic_send_startup(uint32_t apic_id, phys_t page);
+
+// BSP, with PIT running: how much LAPIC timer counts in a PIT tick
+void lapic_timer_calibrate(void);
+// Periodic interrupt on the calling CPU each PIT tick long, for quantum ends
+void lapic_timer_start(void);
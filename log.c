@@ -2,6 +2,7 @@
 #include "print.h"
 #include "interrupt.h"
 #include "threads.h"
+#include "spinlock.h"
 #include <stdarg.h>
 #include <stdbool.h>
 
@@ -9,6 +10,8 @@ static const char* color_reset = "\e[0m";
 
 static const char* colors[_LEVEL_MAX] = {0};
 static int log_level = LEVEL_INFO;
+// Lines of different CPUs don't mix
+static struct spinlock log_lock;
 
 void log_set_color_enabled(bool color_enabled) {
 	if (color_enabled) {
@@ -44,12 +47,12 @@ void vlog_tagged(int level, const char *tag, const char* format, va_list args) {
 		return;
 	}
 	const char* level_color = log_get_color(level);
-	uint64_t rflags = hard_lock();
+	uint64_t rflags = hard_spin_lock(&log_lock);
 	struct thread* current = thread_current();
 	printf("!%s[%02d %s@%s] ", level_color ?: "", level, tag, current ? current->name : "<null>");
 	vprintf(format, args);
 	printf("%s\n", level_color ? color_reset : "");
-	hard_unlock(rflags);
+	hard_spin_unlock(&log_lock, rflags);
 }
 
 void log_tagged(int level, const char *tag, const char* format, ...) {
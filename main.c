@@ -9,8 +9,13 @@
 #include "buddy.h"
 #include "paging.h"
 #include "slab-allocator.h"
+#include "kmalloc.h"
+#include "shrinker.h"
 #include "threads.h"
 #include "cmdline.h"
+#include "timer.h"
+#include "cpu.h"
+#include "smp.h"
 #include "test.h"
 #include "fs.h"
 #include "string.h"
@@ -19,18 +24,24 @@
 
 #include <stdbool.h>
 
+// About 10 s
+#define IDLE_REPORT_TICKS 10000
+
 void init_memory(void) {
 	log(LEVEL_VVV, "Original MMAP:");
 	struct mboot_info* info = mboot_info_get();
 	print_mmap(va(info->mmap_addr), info->mmap_length);
 
+	shrinkers_init();
 	buddy_init();
 	paging_build();
-	buddy_init_high();
 	slab_allocators_init();
+	kmalloc_init();
 }
 
 void main(void) {
+	// Locks need to know the CPU
+	cpu_init_bsp();
 	log_set_level(LEVEL_LOG);
 	log_set_color_enabled(false);
 
@@ -52,6 +63,7 @@ void main(void) {
 	log(LEVEL_INFO, "Interrputs are ready.");
 
 	log(LEVEL_INFO, "Preparing PIT...");
+	timers_init();
 	pit_init();
 	log(LEVEL_INFO, "PIT is ready.");
 
@@ -60,6 +72,13 @@ void main(void) {
 	log(LEVEL_INFO, "Scheduler is ready, multithreading is on.");
 	interrupt_enable();
 
+	log(LEVEL_INFO, "Starting other CPUs...");
+	smp_init();
+
+	log(LEVEL_INFO, "Freeing high memory in background...");
+	buddy_init_high();
+	shrinkers_start();
+
 	log(LEVEL_INFO, "Preparing file system...");
 	fs_init();
 	log(LEVEL_INFO, "File system is ready.");
@@ -69,23 +88,33 @@ void main(void) {
 	log(LEVEL_INFO, "Loading done. Starting ls()...");
 	ls();
 	log(LEVEL_INFO, "ls() done.");
+	slabinfo();
 
 	#ifdef CONFIG_TESTS
 	printf("Starting tests!\n");
+	test_kmalloc();
+	test_slabinfo();
 	test_threads();
+	test_priority();
+	test_fairness();
 	test_condition_variable();
+	test_timer();
 	#endif
 
+	// High memory is freed by now or soon, its thread is not needed after
+	buddy_init_high_join();
+
+	// Idle: only waiting for interrupts, and telling how often they come
+	uint64_t report_ticks = timer_ticks();
+	uint64_t report_interrupts = pit_interrupts();
 	while (true) {
-		int a = 0;
-		for (int i = 0; i != 1000; ++i) {
-			for (int j = 0; j != 1000; ++j) {
-				for (int k = 0; k != 1000; ++k) {
-					a += i + 2 * j + 3 * k;
-				}
-			}
-		}
-		printf("Hello from main %d!\n", a);
 		hlt();
+		uint64_t ticks = timer_ticks() - report_ticks;
+		if (ticks >= IDLE_REPORT_TICKS) {
+			uint64_t count = pit_interrupts() - report_interrupts;
+			log(LEVEL_INFO, "Idle: %llu PIT interrupts per second.", count * PIT_FREQUENCY / (PIT_DIVISOR * ticks));
+			report_ticks += ticks;
+			report_interrupts += count;
+		}
 	}
 }
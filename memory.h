@@ -35,11 +35,22 @@ static inline uintptr_t kernel_phys(void *addr)
 static inline void *kernel_virt(uintptr_t addr)
 { return (void *)KERNEL_VIRT(addr); }
 
+#ifdef CONFIG_HOST_BENCH
+// Host benchmark keeps "physical" memory in its own arena
+extern uintptr_t host_phys_base;
+
+static inline phys_t pa(const void *addr)
+{ return (virt_t)addr - host_phys_base; }
+
+static inline void *va(phys_t addr)
+{ return (void *)(addr + host_phys_base); }
+#else
 static inline phys_t pa(const void *addr)
 { return PA((virt_t)addr); }
 
 static inline void *va(phys_t addr)
 { return (void *)VA(addr); }
+#endif /*CONFIG_HOST_BENCH*/
 
 static inline uintmax_t get_bits(uintmax_t data, int start_bit, int count) {
 	return (data >> start_bit) & ((UINTMAX_C(1) << count) - 1);
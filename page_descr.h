@@ -2,11 +2,22 @@
 
 #include "slab-allocator.h"
 #include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 struct page_descr {
-	struct slab_allocator* slab_allocator;
+	union {
+		// SLAB owning that page, if any
+		struct slab* slab;
+		// Or, for first page of big kmalloc block, its size in pages, shifted and tagged with lowest bit
+		uintptr_t kmalloc_pages;
+	};
 };
 
 static inline void page_descr_init(struct page_descr* page_descr) {
-	page_descr->slab_allocator = NULL;
+	page_descr->slab = NULL;
+}
+
+static inline bool page_descr_is_kmalloc(struct page_descr* page_descr) {
+	return (page_descr->kmalloc_pages & 1) != 0;
 }
@@ -30,7 +30,7 @@ static phys_t paging_new_page(void) {
 	return res;
 }
 
-static void paging_build_region(virt_t start, virt_t length, phys_t base, pte_t pml4) {
+void paging_build_region(virt_t start, virt_t length, phys_t base, pte_t pml4, pte_t flags) {
 	log(LEVEL_V, "From %p to %p, at %p. PML4 is at %p.", start, start + length, base, pte_phys(pml4));
 	virt_t vpos = start;
 	virt_t pos = base;
@@ -48,7 +48,7 @@ static void paging_build_region(virt_t start, virt_t length, phys_t base, pte_t
 		}
 
 		pte_t* pde_p = (pte_t*)va(pte_phys(*pdpte_p)) + pml2_i(vpos);
-		*pde_p = PTE_PRESENT | PTE_WRITE | PTE_LARGE | pos;
+		*pde_p = PTE_PRESENT | PTE_WRITE | PTE_LARGE | flags | pos;
 
 		vpos += BIG_PAGE_SIZE;
 		pos += BIG_PAGE_SIZE;
@@ -65,13 +65,31 @@ void paging_build(void) {
 	mmap_iterate(bootstrap_mmap, bootstrap_mmap_length, (struct mmap_iterator*) &iterator);
 	log(LEVEL_INFO, "Build paging, phys max is %p.", iterator.max_memory);
 	pte_t pml4 = paging_new_page();
-	paging_build_region(HIGH_BASE, iterator.max_memory, PHYSICAL_BASE, pml4);
-	paging_build_region(KERNEL_BASE, KERNEL_SIZE, PHYSICAL_BASE, pml4);
+	paging_build_region(HIGH_BASE, iterator.max_memory, PHYSICAL_BASE, pml4, 0);
+	paging_build_region(KERNEL_BASE, KERNEL_SIZE, PHYSICAL_BASE, pml4, 0);
 	print_paging(pml4);
 	store_pml4(pml4);
 	log(LEVEL_INFO, "Paging upgraded!");
 }
 
+void paging_map_io(phys_t base, uint64_t length) {
+	phys_t begin = base & ~((phys_t)(BIG_PAGE_SIZE) - 1);
+	phys_t end = (base + length + (BIG_PAGE_SIZE) - 1) & ~((phys_t)(BIG_PAGE_SIZE) - 1);
+	log(LEVEL_V, "Mapping IO [%p..%p).", begin, end);
+	paging_build_region(VA(begin), end - begin, begin, load_pml4(), PTE_PCD | PTE_PWT);
+	flush_tlb();
+}
+
+pte_t paging_clone(void) {
+	pte_t pml4 = paging_new_page();
+	pte_t* from = (pte_t*)va(pte_phys(load_pml4()));
+	pte_t* to = (pte_t*)va(pml4);
+	for (int i = 0; i != PTE_COUNT; ++i) {
+		to[i] = from[i];
+	}
+	return pml4;
+}
+
 void print_paging(pte_t pml4) {
 	log(LEVEL_VVV, "CR3: PML4 at %p.", pte_phys(pml4));
 	for (int i4 = 0; i4 != PTE_COUNT; ++i4) {
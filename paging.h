@@ -13,6 +13,8 @@ typedef uint64_t pte_t;
 #define PTE_PRESENT ((pte_t)1 << 0)
 #define PTE_WRITE   ((pte_t)1 << 1)
 #define PTE_USER    ((pte_t)1 << 2)
+#define PTE_PWT     ((pte_t)1 << 3)
+#define PTE_PCD     ((pte_t)1 << 4)
 #define PTE_LARGE   ((pte_t)1 << 7)
 
 static inline bool pte_present(pte_t pte)
@@ -82,6 +84,12 @@ static inline void flush_tlb(void)
 { store_pml4(load_pml4()); }
 
 void paging_build(void);
+// Maps [start, start + length) to base with 2 MiB pages, with extra flags
+void paging_build_region(virt_t start, virt_t length, phys_t base, pte_t pml4, pte_t flags);
+// Device registers, at va() of their address but uncached
+void paging_map_io(phys_t base, uint64_t length);
+// New PML4 sharing everything with the current one
+pte_t paging_clone(void);
 void print_paging(pte_t pml4);
 
 #endif /*__PAGING_H__*/
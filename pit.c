@@ -3,24 +3,105 @@
 #include "pic.h"
 #include "memory.h"
 #include "threads.h"
+#include "timer.h"
+#include "log.h"
+#include "spinlock.h"
+
+static bool is_tickless = false;
+// Current mode, and ticks to the one-shot interrupt from the previous one
+static bool is_one_shot = false;
+static uint64_t one_shot_ticks;
+// Mode and the ports, timers are added on any CPU
+static struct spinlock pit_lock;
+static volatile uint64_t interrupts = 0;
+
+static void pit_program(uint8_t command, uint16_t count) {
+	out8(PORT_PIT_CONTROL, command);
+	out8(PORT_PIT_DATA, get_bits(count, 0, 8));
+	out8(PORT_PIT_DATA, get_bits(count, 8, 8));
+}
+
+static uint16_t pit_read_count(void) {
+	out8(PORT_PIT_CONTROL, PIT_COMMAND_LATCH);
+	uint16_t low = in8(PORT_PIT_DATA);
+	uint16_t high = in8(PORT_PIT_DATA);
+	return low | (high << 8);
+}
+
+// Periodic while someone waits for the quantum end, one-shot to the next timer otherwise
+static void pit_program_next(void) {
+	if (!scheduler_is_alone()) {
+		if (is_one_shot) {
+			pit_program(PIT_COMMAND_SET_RATE_GENERATOR, PIT_DIVISOR);
+			is_one_shot = false;
+		}
+		return;
+	}
+	one_shot_ticks = timer_next_event(PIT_ONE_SHOT_MAX_TICKS);
+	pit_program(PIT_COMMAND_SET_ONE_SHOT, one_shot_ticks * PIT_DIVISOR);
+	is_one_shot = true;
+}
+
+void pit_timer_added(uint64_t ticks) {
+	uint64_t rflags = hard_spin_lock(&pit_lock);
+	if (!is_one_shot || ticks >= one_shot_ticks) {
+		hard_spin_unlock(&pit_lock, rflags);
+		return;
+	}
+	uint64_t programmed = one_shot_ticks * PIT_DIVISOR;
+	uint64_t left = pit_read_count();
+	// Counter wrapped otherwise, interrupt is pending already
+	if (left <= programmed) {
+		uint64_t passed = programmed - left;
+		uint64_t wanted = ticks * PIT_DIVISOR;
+		pit_program(PIT_COMMAND_SET_ONE_SHOT, wanted > passed ? wanted - passed : 1);
+		one_shot_ticks = ticks;
+	}
+	hard_spin_unlock(&pit_lock, rflags);
+}
+
+uint64_t pit_interrupts(void) {
+	return interrupts;
+}
 
 void pit_handler(struct interrupt_info* info) {
 	pic_eoi(false);
 	
 	static int counter = 0;
 	static int number = 0;
-	++counter;
-	if (counter >= PIT_TICKS) {
+	++interrupts;
+	// Other CPUs add timers meanwhile
+	uint64_t rflags = hard_spin_lock(&pit_lock);
+	uint64_t elapsed = is_one_shot ? one_shot_ticks : 1;
+	hard_spin_unlock(&pit_lock, rflags);
+	counter += elapsed;
+	bool is_woken = timer_tick(elapsed);
+	// Before switching, this thread may not be back soon
+	if (is_tickless) {
+		rflags = hard_spin_lock(&pit_lock);
+		pit_program_next();
+		hard_spin_unlock(&pit_lock, rflags);
+	}
+	// Threads woken by timers don't wait for the quantum end, idle takes work as soon as there is some
+	bool is_quantum_over = counter >= PIT_TICKS || is_woken;
+	if (is_quantum_over) {
 		++number;
 		counter = 0;
+	}
+	bool should_schedule = (is_quantum_over || thread_current()->is_idle) && !scheduler_is_alone();
+	if (should_schedule) {
 		schedule(THREAD_NEW_STATE_ALIVE);
 	}
 }
 
+void pit_set_tickless(bool is_enabled) {
+	is_tickless = is_enabled;
+}
+
 void pit_init(void) {
-	out8(PORT_PIT_CONTROL, PIT_COMMAND_SET_RATE_GENERATOR);
-	out8(PORT_PIT_DATA, get_bits(PIT_DIVISOR, 0, 8));
-	out8(PORT_PIT_DATA, get_bits(PIT_DIVISOR, 8, 8));
+	spin_init(&pit_lock);
+	pit_program(PIT_COMMAND_SET_RATE_GENERATOR, PIT_DIVISOR);
+	log(LEVEL_INFO, "Ticks are %s.", is_tickless ? "dynamic" : "periodic");
 
 	interrupt_set(INTERRUPT_PIT, pit_handler);
 }
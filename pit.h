@@ -1,12 +1,26 @@
 #pragma once
 
 #include "interrupt.h"
+#include "kernel_config.h"
 #include <stdint.h>
+#include <stdbool.h>
 
 #define PORT_PIT_DATA    0x40
 #define PORT_PIT_CONTROL 0x43
 
 #define PIT_FREQUENCY 1193180
 #define PIT_COMMAND_SET_RATE_GENERATOR 0b00110100
+// Interrupt on terminal count, once
+#define PIT_COMMAND_SET_ONE_SHOT       0b00110000
+#define PIT_COMMAND_LATCH              0b00000000
+
+// Longest one-shot, counter is 16 bit (about 54 ms)
+#define PIT_ONE_SHOT_MAX_TICKS (0xffffu / PIT_DIVISOR)
 
 void pit_init(void);
+// Called from cmdline, before pit_init. When no thread waits for its turn,
+// PIT fires once at the next timer instead of every tick.
+void pit_set_tickless(bool is_enabled);
+// Any CPU, with no timer lock held: a timer was added that needs that many interrupts
+void pit_timer_added(uint64_t ticks);
+uint64_t pit_interrupts(void);
@@ -0,0 +1,92 @@
+#include "shrinker.h"
+#include "threads.h"
+#include "log.h"
+
+static struct {
+	// Registered shrinkers
+	struct mutex lock;
+	struct list_node shrinkers_head;
+
+	// Background thread, request is under hard lock
+	struct mutex wake_lock;
+	struct condition_variable wake;
+	uint64_t requested;
+} shrinkers;
+
+void shrinkers_init(void) {
+	mutex_init(&shrinkers.lock);
+	list_init(&shrinkers.shrinkers_head);
+	mutex_init(&shrinkers.wake_lock);
+	cv_init(&shrinkers.wake, &shrinkers.wake_lock);
+	shrinkers.requested = 0;
+}
+
+void shrinker_register(struct shrinker* shrinker) {
+	mutex_lock(&shrinkers.lock);
+	list_add_tail(&shrinker->link, &shrinkers.shrinkers_head);
+	mutex_unlock(&shrinkers.lock);
+}
+
+void shrinker_unregister(struct shrinker* shrinker) {
+	mutex_lock(&shrinkers.lock);
+	list_delete(&shrinker->link);
+	mutex_unlock(&shrinkers.lock);
+}
+
+uint64_t shrink(uint64_t pages) {
+	// Shrinker may free memory that needs allocation (or be the one who failed it), no recursion then
+	if (!mutex_try_lock(&shrinkers.lock)) {
+		return 0;
+	}
+	uint64_t released = 0;
+	for (
+			struct list_node* list_node = list_first(&shrinkers.shrinkers_head);
+			list_node != &shrinkers.shrinkers_head && released < pages;
+			list_node = list_node->next
+	) {
+		struct shrinker* shrinker = LIST_ENTRY(list_node, struct shrinker, link);
+		if (shrinker->count(shrinker) == 0) {
+			continue;
+		}
+		uint64_t shrinker_released = shrinker->scan(shrinker, pages - released);
+		log(LEVEL_VV, "Shrinker %s released %llu pages.", shrinker->name, shrinker_released);
+		released += shrinker_released;
+	}
+	mutex_unlock(&shrinkers.lock);
+	return released;
+}
+
+void shrinker_wake(uint64_t pages) {
+	uint64_t rflags = hard_lock();
+	if (shrinkers.requested == 0) {
+		cv_notify(&shrinkers.wake);
+	}
+	if (shrinkers.requested < pages) {
+		shrinkers.requested = pages;
+	}
+	hard_unlock(rflags);
+}
+
+static void* shrinker_thread(void* data) {
+	while (true) {
+		mutex_lock(&shrinkers.wake_lock);
+		uint64_t rflags = hard_lock();
+		while (shrinkers.requested == 0) {
+			cv_wait(&shrinkers.wake);
+		}
+		uint64_t pages = shrinkers.requested;
+		shrinkers.requested = 0;
+		hard_unlock(rflags);
+		mutex_unlock(&shrinkers.wake_lock);
+
+		uint64_t released = shrink(pages);
+		log(LEVEL_V, "Background shrink: %llu of %llu pages released.", released, pages);
+	}
+	return NULL;
+}
+
+void shrinkers_start(void) {
+	if (thread_create(shrinker_thread, NULL, "shrinker") == NULL) {
+		log(LEVEL_WARN, "Failed to start shrinker thread, memory is shrunk only on failures.");
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "list.h"
+#include <stdint.h>
+
+struct shrinker;
+
+// How many pages can be released
+typedef uint64_t (*shrinker_count_t)(struct shrinker* shrinker);
+// Try to release that many pages, returns how many were released
+typedef uint64_t (*shrinker_scan_t)(struct shrinker* shrinker, uint64_t pages);
+
+// Something keeping memory it can give back to buddy (i.e. caches)
+struct shrinker {
+	struct list_node link;
+	const char* name;
+	shrinker_count_t count;
+	shrinker_scan_t scan;
+};
+
+void shrinkers_init(void);
+// Starts background thread that shrinks when asked by shrinker_wake
+void shrinkers_start(void);
+
+void shrinker_register(struct shrinker* shrinker);
+void shrinker_unregister(struct shrinker* shrinker);
+
+// Release up to that many pages right now. Shrinkers busy with the caller are skipped.
+uint64_t shrink(uint64_t pages);
+// Ask background thread to release that many pages, may be called with hard lock
+void shrinker_wake(uint64_t pages);
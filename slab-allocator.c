@@ -1,218 +1,745 @@
 #include "slab-allocator.h"
 #include "buddy.h"
 #include "log.h"
+#include "print.h"
 
-// Small slab
+static bool is_coloring = true;
 
-static struct slab* slab_small_new(struct slab_allocator* main, uint16_t size, uint16_t align) {
-	phys_t page = buddy_alloc(0);
-	if (page == (phys_t)NULL) {
-		return NULL;
-	}
-	struct slab* slab = (struct slab*)( (virt_t)va(page) + PAGE_SIZE - sizeof(struct slab) );
-	list_init(&slab->link);
-	list_init(&slab->nodes_head);
-	slab->page = page;
+// Free objects are linked through a word in them, so objects carry no headers.
+// If objects have constructor, that word is placed after the object, so it stays constructed.
 
-	virt_t block_size = sizeof(struct slab_node) + size;
-	virt_t shift = ((block_size + align - 1) / align) * align;
+static inline void** slab_obj_next(struct slab_allocator* main, void* ptr) {
+	return (void**)((virt_t)ptr + main->free_offset);
+}
 
-	for (virt_t pos = (virt_t)va(page); pos + shift <= (virt_t)slab; pos += shift) {
-		struct slab_node* node = (struct slab_node*) pos;
-		node->data = (void*)( pos + sizeof(struct slab_node) );
-		list_add(&node->link, &slab->nodes_head);
+static void slab_fill(struct slab* slab, virt_t start, virt_t end) {
+	struct slab_allocator* main = slab->allocator;
+	slab->free_list = NULL;
+	slab->in_use = 0;
+	slab->capacity = 0;
+	// Backwards, so objects are handed out from the page start
+	for (virt_t pos = start + (end - start) / main->obj_shift * main->obj_shift; pos != start; ) {
+		pos -= main->obj_shift;
+		if (main->ctor != NULL) {
+			main->ctor((void*)pos);
+		}
+		*slab_obj_next(main, (void*)pos) = slab->free_list;
+		slab->free_list = (void*)pos;
+		++slab->capacity;
 	}
-	page_descr_for(page)->slab_allocator = main;
-	log(LEVEL_V, "New small slab created at page %p for size=%hu, align=%hu.", page, size, align);
-	return slab;
 }
 
-static void slab_small_delete(struct slab* slab) {
-	log(LEVEL_V, "Small slab deleted from page %p.", slab->page);
-	page_descr_for(slab->page)->slab_allocator = NULL;
-	buddy_free(slab->page);
+// All objects must be free
+static void slab_clear(struct slab* slab) {
+	struct slab_allocator* main = slab->allocator;
+	if (main->dtor == NULL) {
+		return;
+	}
+	for (uint16_t i = 0; i != slab->capacity; ++i) {
+		main->dtor((void*)((virt_t)va(slab->page) + slab->color + i * main->obj_shift));
+	}
 }
 
-static void* slab_small_alloc(struct slab* slab) {
-	if (list_empty(&slab->nodes_head)) {
-		return NULL;
+static void* slab_obj_alloc(struct slab* slab) {
+	void* ptr = slab->free_list;
+	if (ptr != NULL) {
+		slab->free_list = *slab_obj_next(slab->allocator, ptr);
 	}
-	struct slab_node* node = LIST_ENTRY(list_first(&slab->nodes_head), struct slab_node, link);
-	void* ptr = node->data;
-	list_delete(&node->link);
 	return ptr;
 }
 
-static void slab_small_free(struct slab* slab, void* ptr) {
-	struct slab_node* node = (struct slab_node*)( (virt_t)ptr - sizeof(struct slab_node) );
-	list_add(&node->link, &slab->nodes_head);
+static void slab_obj_free(struct slab* slab, void* ptr) {
+	*slab_obj_next(slab->allocator, ptr) = slab->free_list;
+	slab->free_list = ptr;
 }
 
-// Big
+// Slabs
 
 static struct slab_allocator big_slab_struct_allocator;
-static struct slab_allocator big_slab_node_allocator;
 
-static void slab_big_delete(struct slab* slab);
+// Small objects always have header on page, so headers allocator never needs another one
+static bool slab_is_header_on_page(struct slab_allocator* main, int order) {
+	return main->obj_size <= SLAB_SMALL || ((uint64_t)PAGE_SIZE << order) % main->obj_shift >= sizeof(struct slab);
+}
 
-static struct slab* slab_big_new(struct slab_allocator* main, uint16_t size, uint16_t align) {
-	struct slab* slab = (struct slab*) slab_alloc(&big_slab_struct_allocator);
-	if (slab == NULL) {
-		return NULL;
+static uint16_t slab_capacity(struct slab_allocator* main, int order) {
+	uint64_t size = PAGE_SIZE << order;
+	if (slab_is_header_on_page(main, order)) {
+		size -= sizeof(struct slab);
 	}
-	phys_t page = buddy_alloc(0);
-	if (page == (phys_t) NULL) {
-		slab_free(slab);
-		return NULL;
+	return size / main->obj_shift;
+}
+
+static uint16_t slab_color_step(struct slab_allocator* main) {
+	return main->obj_align > SLAB_COLOR_STEP ? main->obj_align : SLAB_COLOR_STEP;
+}
+
+// Bytes left after objects, the first one can be moved by up to that
+static uint64_t slab_leftover(struct slab_allocator* main, int order) {
+	uint64_t size = PAGE_SIZE << order;
+	if (slab_is_header_on_page(main, order)) {
+		size -= sizeof(struct slab);
 	}
+	return size - (uint64_t)slab_capacity(main, order) * main->obj_shift;
+}
 
-	list_init(&slab->link);
-	list_init(&slab->nodes_head);
-	slab->page = page;
+static uint16_t slab_colors(struct slab_allocator* main, int order) {
+	if (!is_coloring) {
+		return 1;
+	}
+	return slab_leftover(main, order) / slab_color_step(main) + 1;
+}
+
+static void slab_set_page_descrs(struct slab* slab, struct slab* value) {
+	for (uint64_t i = 0; i != (1ull << slab->order); ++i) {
+		page_descr_for(slab->page + i * PAGE_SIZE)->slab = value;
+	}
+}
 
-	virt_t shift = ((size + align - 1) / align) * align;
-	for (virt_t pos = (virt_t)va(page); pos + shift <= (virt_t)va(page) + PAGE_SIZE; pos += shift) {
-		struct slab_node* node = (struct slab_node*)slab_alloc(&big_slab_node_allocator);
-		if (node == NULL) {
-			slab_big_delete(slab);
+static struct slab* slab_new_order(struct slab_allocator* main, int order) {
+	++main->grows;
+	phys_t page = buddy_alloc(order);
+	if (page == (phys_t)NULL) {
+		return NULL;
+	}
+	virt_t start = (virt_t)va(page);
+	virt_t end = start + (PAGE_SIZE << order);
+	struct slab* slab;
+	if (slab_is_header_on_page(main, order)) {
+		slab = (struct slab*)(end - sizeof(struct slab));
+		end = (virt_t)slab;
+	} else {
+		slab = (struct slab*) slab_alloc(&big_slab_struct_allocator);
+		if (slab == NULL) {
+			buddy_free(page);
 			return NULL;
 		}
-		node->data = (void*)pos;
-		list_add(&node->link, &slab->nodes_head);
 	}
-	page_descr_for(page)->slab_allocator = main;
-	log(LEVEL_V, "New big slab created at page %p for size=%hu, align=%hu.", page, size, align);
+	list_init(&slab->link);
+	slab->page = page;
+	slab->order = order;
+	slab->allocator = main;
+	// Colors go round, so same fields of objects in different slabs fall into different cache sets
+	if (main->color_next > slab_leftover(main, order)) {
+		main->color_next = 0;
+	}
+	slab->color = is_coloring ? main->color_next : 0;
+	main->color_next += slab_color_step(main);
+	slab_fill(slab, start + slab->color, end);
+	slab_set_page_descrs(slab, slab);
+	++main->slabs;
+	main->objects_total += slab->capacity;
+	log(LEVEL_V, "New slab of order %d created at page %p for size=%hu, align=%hu.", order, page, main->obj_size, main->obj_align);
 	return slab;
 }
 
-static void slab_big_delete(struct slab* slab) {
-	page_descr_for(slab->page)->slab_allocator = NULL;
-	for (struct list_node* list_node = list_first(&slab->nodes_head); list_node != &slab->nodes_head; ) {
-		struct slab_node* node = LIST_ENTRY(list_node, struct slab_node, link);
-		list_node = list_node->next;
-		slab_free(node);
+static struct slab* slab_new(struct slab_allocator* main) {
+	struct slab* slab = slab_new_order(main, main->order);
+	if (slab == NULL && main->order != 0) {
+		// Memory may be too fragmented for bigger slabs
+		slab = slab_new_order(main, 0);
 	}
-	log(LEVEL_V, "Big slab deleted from page %p.", slab->page);
+	return slab;
+}
+
+// Returns pages to buddy, header is left to caller if it is not on them
+static bool slab_release(struct slab* slab) {
+	log(LEVEL_V, "Slab of order %d deleted from page %p.", slab->order, slab->page);
+	slab_clear(slab);
+	--slab->allocator->slabs;
+	slab->allocator->objects_total -= slab->capacity;
+	slab_set_page_descrs(slab, NULL);
 	buddy_free(slab->page);
+	return slab_is_header_on_page(slab->allocator, slab->order);
 }
 
-static void* slab_big_alloc(struct slab* slab) {
-	if (list_empty(&slab->nodes_head)) {
-		return NULL;
+static void slab_delete(struct slab* slab) {
+	if (!slab_release(slab)) {
+		slab_free(slab);
 	}
-	struct slab_node* node = LIST_ENTRY(&slab->nodes_head, struct slab_node, link);
-	void* ptr = node->data;
-	list_delete(&node->link);
-	slab_free(node);
-	return ptr;
 }
 
-static void slab_big_free(struct slab* slab, void* ptr) {
-	struct slab_node* node = (struct slab_node*)slab_alloc(&big_slab_node_allocator);
-	if (node == NULL) {
-		halt("No memory for new slab node to free memory!");
+// The smallest order wasting at most 1/SLAB_WASTE_PART of a slab, or the one wasting least
+static void slab_choose_order(struct slab_allocator* main) {
+	uint64_t best_waste = 0;
+	for (int order = 0; order <= SLAB_MAX_ORDER; ++order) {
+		uint64_t size = PAGE_SIZE << order;
+		uint64_t waste = size - (uint64_t)slab_capacity(main, order) * main->obj_shift;
+		// Compare fractions waste / size
+		if (order == 0 || waste * (PAGE_SIZE << main->order) < best_waste * size) {
+			main->order = order;
+			best_waste = waste;
+		}
+		if (waste * SLAB_WASTE_PART <= size) {
+			break;
+		}
 	}
-	node->data = ptr;
-	list_add(&slab->nodes_head, &node->link);
 }
 
 // Allocator
 
+static struct slab_allocator magazine_allocator;
+
+// Counters shared with magazines fast path of all CPUs
+static void slab_count(uint64_t* counter, uint64_t count) {
+	__atomic_fetch_add(counter, count, __ATOMIC_RELAXED);
+}
+
+// All allocators, for slabinfo
+static struct list_node slab_allocators_head;
+static struct mutex slab_allocators_lock;
+
+static void slab_init_raw(struct slab_allocator* slab_allocator, const char* name, uint16_t size, uint16_t align,
+		slab_ctor_t ctor, slab_dtor_t dtor, bool use_magazines);
+
+void slab_set_coloring(bool is_enabled) {
+	is_coloring = is_enabled;
+}
+
 void slab_allocators_init(void) {
-	slab_init(&big_slab_struct_allocator, sizeof(struct slab)     , 1);
-	slab_init(&big_slab_node_allocator  , sizeof(struct slab_node), 1);
+	list_init(&slab_allocators_head);
+	mutex_init(&slab_allocators_lock);
+	// Magazines are not used for them, or freeing an object could need a new magazine from the same allocator
+	slab_init_raw(&big_slab_struct_allocator, "struct slab", sizeof(struct slab), _Alignof(struct slab), NULL, NULL, false);
+	slab_init_raw(&magazine_allocator, "struct slab_magazine", sizeof(struct slab_magazine), _Alignof(struct slab_magazine),
+			NULL, NULL, false);
 }
 
-void slab_init(struct slab_allocator* slab_allocator, uint16_t size, uint16_t align) {
-	mutex_init(&slab_allocator->lock);
-	slab_allocator->obj_size = size;
-	slab_allocator->obj_align = align;
-	struct slab* slab;
-	if (size <= SLAB_SMALL) {
-		slab = slab_small_new(slab_allocator, size, align);
-	} else {
-		slab = slab_big_new(slab_allocator, size, align);
+static void slab_delete_all(struct list_node* head) {
+	while (!list_empty(head)) {
+		struct slab* slab = LIST_ENTRY(list_first(head), struct slab, link);
+		list_delete(&slab->link);
+		slab_delete(slab);
 	}
-	list_add(&slab_allocator->slabs_head, &slab->link);
 }
 
-void slab_finit(struct slab_allocator* slab_allocator) {
-	for (struct list_node* list_node = list_first(&slab_allocator->slabs_head); list_node != &slab_allocator->slabs_head; ) {
-		struct slab* slab = LIST_ENTRY(list_node, struct slab, link);
-		list_node = list_node->next;
-		if (slab_allocator->obj_size <= SLAB_SMALL) {
-			slab_small_delete(slab);
+// Free objects of a slab are taken in a run, so slab lists are touched once per slab
+static int __slab_alloc_bulk(struct slab_allocator* slab_allocator, int count, void** ptrs) {
+	int allocated = 0;
+	while (allocated != count) {
+		struct slab* slab;
+		if (!list_empty(&slab_allocator->partial_head)) {
+			slab = LIST_ENTRY(list_first(&slab_allocator->partial_head), struct slab, link);
+		} else if (!list_empty(&slab_allocator->empty_head)) {
+			slab = LIST_ENTRY(list_first(&slab_allocator->empty_head), struct slab, link);
+			--slab_allocator->empty_count;
 		} else {
-			slab_big_delete(slab);
+			slab = slab_new(slab_allocator);
+			if (slab == NULL) {
+				break;
+			}
+		}
+		while (allocated != count && slab->in_use != slab->capacity) {
+			ptrs[allocated++] = slab_obj_alloc(slab);
+			++slab->in_use;
+		}
+		list_delete(&slab->link);
+		if (slab->in_use == slab->capacity) {
+			list_add(&slab->link, &slab_allocator->full_head);
+		} else {
+			list_add(&slab->link, &slab_allocator->partial_head);
 		}
 	}
-	mutex_finit(&slab_allocator->lock);
+	return allocated;
 }
 
 static void* __slab_alloc(struct slab_allocator* slab_allocator) {
-	struct slab* slab;
-	for (
-			struct list_node* list_node = list_first(&slab_allocator->slabs_head);
-			list_node != &slab_allocator->slabs_head;
-			list_node = list_node->next
-	) {
-		slab = LIST_ENTRY(list_node, struct slab, link);
-		void* ptr;
-		if (slab_allocator->obj_size <= SLAB_SMALL) {
-			ptr = slab_small_alloc(slab);
+	void* ptr = NULL;
+	__slab_alloc_bulk(slab_allocator, 1, &ptr);
+	return ptr;
+}
+
+static void __slab_free(struct slab_allocator* slab_allocator, void* ptr) {
+	struct slab* slab = page_descr_for(pa(ptr))->slab;
+	slab_obj_free(slab, ptr);
+	--slab->in_use;
+	if (slab->in_use == 0) {
+		list_delete(&slab->link);
+		if (slab_allocator->empty_count < slab_allocator->empty_max) {
+			list_add(&slab->link, &slab_allocator->empty_head);
+			++slab_allocator->empty_count;
 		} else {
-			ptr = slab_big_alloc(slab);
+			// Enough empty slabs are kept already
+			slab_delete(slab);
 		}
-		if (ptr) {
-			return ptr;
+	} else if (slab->in_use == slab->capacity - 1) {
+		// Was full
+		list_delete(&slab->link);
+		list_add(&slab->link, &slab_allocator->partial_head);
+	}
+}
+
+// Magazines. Loaded & previous ones of a CPU are under its spinlock, depot is under allocator lock.
+// Allocator lock may sleep, so it is taken before the spinlock, and depot is touched with no spinlock held.
+
+static struct slab_cpu_magazines* slab_this_magazines(struct slab_allocator* slab_allocator) {
+	return &slab_allocator->magazines[cpu_current_id()];
+}
+
+static void slab_magazine_flush(struct slab_allocator* slab_allocator, struct slab_magazine* magazine) {
+	while (magazine->rounds != 0) {
+		__slab_free(slab_allocator, magazine->objects[--magazine->rounds]);
+	}
+}
+
+static void slab_depot_put(struct slab_allocator* slab_allocator, struct slab_magazine* magazine) {
+	if (magazine == NULL) {
+		return;
+	}
+	if (magazine->rounds == 0) {
+		if (slab_allocator->depot_empty_count < SLAB_DEPOT_MAX) {
+			list_add(&magazine->link, &slab_allocator->depot_empty_head);
+			++slab_allocator->depot_empty_count;
+			return;
 		}
+	} else if (slab_allocator->depot_full_count < SLAB_DEPOT_MAX) {
+		list_add(&magazine->link, &slab_allocator->depot_full_head);
+		++slab_allocator->depot_full_count;
+		return;
 	}
-	// At this point, there is no free slab
-	if (slab_allocator->obj_size <= SLAB_SMALL) {
-		slab = slab_small_new(slab_allocator, slab_allocator->obj_size, slab_allocator->obj_align);
-		if (slab == NULL) {
-			return NULL;
+	// Depot is full, objects go back to slabs
+	slab_magazine_flush(slab_allocator, magazine);
+	slab_free(magazine);
+}
+
+static struct slab_magazine* slab_depot_get(struct slab_allocator* slab_allocator, bool is_full) {
+	struct list_node* head = is_full ? &slab_allocator->depot_full_head : &slab_allocator->depot_empty_head;
+	if (list_empty(head)) {
+		return NULL;
+	}
+	struct slab_magazine* magazine = LIST_ENTRY(list_first(head), struct slab_magazine, link);
+	list_delete(&magazine->link);
+	if (is_full) {
+		--slab_allocator->depot_full_count;
+	} else {
+		--slab_allocator->depot_empty_count;
+	}
+	return magazine;
+}
+
+static bool slab_magazine_pop(struct slab_cpu_magazines* magazines, void** ptr) {
+	struct slab_magazine* loaded = magazines->loaded;
+	if (loaded == NULL || loaded->rounds == 0) {
+		struct slab_magazine* previous = magazines->previous;
+		if (previous == NULL || previous->rounds == 0) {
+			return false;
+		}
+		magazines->previous = loaded;
+		magazines->loaded = loaded = previous;
+	}
+	*ptr = loaded->objects[--loaded->rounds];
+	return true;
+}
+
+static bool slab_magazine_push(struct slab_cpu_magazines* magazines, void* ptr) {
+	struct slab_magazine* loaded = magazines->loaded;
+	if (loaded == NULL || loaded->rounds == SLAB_MAGAZINE_SIZE) {
+		struct slab_magazine* previous = magazines->previous;
+		if (previous == NULL || previous->rounds == SLAB_MAGAZINE_SIZE) {
+			return false;
+		}
+		magazines->previous = loaded;
+		magazines->loaded = loaded = previous;
+	}
+	loaded->objects[loaded->rounds++] = ptr;
+	return true;
+}
+
+static void* slab_alloc_slow(struct slab_allocator* slab_allocator) {
+	mutex_lock(&slab_allocator->lock);
+	void* ptr = NULL;
+	struct slab_magazine* full = slab_depot_get(slab_allocator, true);
+	struct slab_magazine* empty = NULL;
+	struct slab_cpu_magazines* magazines = slab_this_magazines(slab_allocator);
+	uint64_t rflags = hard_spin_lock(&magazines->lock);
+	if (!slab_magazine_pop(magazines, &ptr) && full != NULL) {
+		// Both magazines are empty, previous one goes to depot
+		empty = magazines->previous;
+		magazines->previous = magazines->loaded;
+		magazines->loaded = full;
+		full = NULL;
+		slab_magazine_pop(magazines, &ptr);
+	}
+	hard_spin_unlock(&magazines->lock, rflags);
+	// Not needed, if some object was there after all
+	slab_depot_put(slab_allocator, full);
+	slab_depot_put(slab_allocator, empty);
+	if (ptr == NULL) {
+		ptr = __slab_alloc(slab_allocator);
+	}
+	mutex_unlock(&slab_allocator->lock);
+	return ptr;
+}
+
+static void slab_free_slow(struct slab_allocator* slab_allocator, void* ptr) {
+	mutex_lock(&slab_allocator->lock);
+	struct slab_magazine* empty = slab_depot_get(slab_allocator, false);
+	if (empty == NULL) {
+		empty = (struct slab_magazine*) slab_alloc(&magazine_allocator);
+		if (empty != NULL) {
+			empty->rounds = 0;
+		}
+	}
+	struct slab_cpu_magazines* magazines = slab_this_magazines(slab_allocator);
+	uint64_t rflags = hard_spin_lock(&magazines->lock);
+	struct slab_magazine* full = NULL;
+	if (!slab_magazine_push(magazines, ptr)) {
+		if (empty != NULL) {
+			// Both magazines are full, previous one goes to depot
+			full = magazines->previous;
+			magazines->previous = magazines->loaded;
+			magazines->loaded = empty;
+			empty = NULL;
+			slab_magazine_push(magazines, ptr);
+			ptr = NULL;
 		}
-		list_add(&slab->link, &slab_allocator->slabs_head);
-		return slab_small_alloc(slab);
 	} else {
-		slab = slab_big_new(slab_allocator, slab_allocator->obj_size, slab_allocator->obj_align);
-		if (slab == NULL) {
-			return NULL;
+		ptr = NULL;
+	}
+	hard_spin_unlock(&magazines->lock, rflags);
+	slab_depot_put(slab_allocator, full);
+	slab_depot_put(slab_allocator, empty);
+	if (ptr != NULL) {
+		// No magazine for it
+		__slab_free(slab_allocator, ptr);
+	}
+	mutex_unlock(&slab_allocator->lock);
+}
+
+// Shrinker. It is called when memory is short, possibly with some allocator locks held by the caller,
+// so it only tries locks and skips what is busy.
+
+static uint64_t slab_shrinker_count(struct shrinker* shrinker) {
+	struct slab_allocator* slab_allocator = LIST_ENTRY(shrinker, struct slab_allocator, shrinker);
+	// Racy, but it is only a hint. Objects in magazines may free some slabs too.
+	bool has_magazines = slab_allocator->depot_full_count != 0;
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		has_magazines |= slab_allocator->magazines[cpu].loaded != NULL;
+	}
+	return ((uint64_t)slab_allocator->empty_count << slab_allocator->order) + has_magazines;
+}
+
+static uint64_t slab_shrinker_scan(struct shrinker* shrinker, uint64_t pages) {
+	struct slab_allocator* slab_allocator = LIST_ENTRY(shrinker, struct slab_allocator, shrinker);
+	if (!mutex_try_lock(&slab_allocator->lock)) {
+		return 0;
+	}
+	// Objects from magazines go back to slabs, without deleting any yet.
+	// Magazines themselves are kept in depot, freeing them may need the lock of the one who called us.
+	uint32_t empty_max = slab_allocator->empty_max;
+	slab_allocator->empty_max = UINT32_MAX;
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		struct slab_cpu_magazines* magazines = &slab_allocator->magazines[cpu];
+		uint64_t rflags = hard_spin_lock(&magazines->lock);
+		struct slab_magazine* loaded[] = {magazines->loaded, magazines->previous};
+		magazines->loaded = NULL;
+		magazines->previous = NULL;
+		hard_spin_unlock(&magazines->lock, rflags);
+		for (int i = 0; i != 2; ++i) {
+			if (loaded[i] != NULL) {
+				slab_magazine_flush(slab_allocator, loaded[i]);
+				list_add(&loaded[i]->link, &slab_allocator->depot_empty_head);
+				++slab_allocator->depot_empty_count;
+			}
+		}
+	}
+	while (!list_empty(&slab_allocator->depot_full_head)) {
+		struct slab_magazine* magazine = slab_depot_get(slab_allocator, true);
+		slab_magazine_flush(slab_allocator, magazine);
+		list_add(&magazine->link, &slab_allocator->depot_empty_head);
+		++slab_allocator->depot_empty_count;
+	}
+	slab_allocator->empty_max = empty_max;
+
+	// Then empty slabs, all of them if needed
+	uint64_t released = 0;
+	bool is_headers_locked = false;
+	while (released < pages && !list_empty(&slab_allocator->empty_head)) {
+		struct slab* slab = LIST_ENTRY(list_first(&slab_allocator->empty_head), struct slab, link);
+		bool is_header_on_page = slab_is_header_on_page(slab_allocator, slab->order);
+		if (!is_header_on_page && !is_headers_locked) {
+			if (!mutex_try_lock(&big_slab_struct_allocator.lock)) {
+				break;
+			}
+			is_headers_locked = true;
 		}
-		list_add(&slab->link, &slab_allocator->slabs_head);
-		return slab_big_alloc(slab);
+		list_delete(&slab->link);
+		--slab_allocator->empty_count;
+		released += 1ull << slab->order;
+		if (!slab_release(slab)) {
+			__slab_free(&big_slab_struct_allocator, slab);
+			slab_count(&big_slab_struct_allocator.frees, 1);
+		}
+	}
+	if (is_headers_locked) {
+		mutex_unlock(&big_slab_struct_allocator.lock);
 	}
+	mutex_unlock(&slab_allocator->lock);
+	return released;
 }
 
-void* slab_alloc(struct slab_allocator* slab_allocator) {
+static void slab_init_raw(struct slab_allocator* slab_allocator, const char* name, uint16_t size, uint16_t align,
+		slab_ctor_t ctor, slab_dtor_t dtor, bool use_magazines) {
+	slab_allocator->name = name;
+	mutex_init(&slab_allocator->lock);
+	slab_allocator->obj_size = size;
+	slab_allocator->obj_align = align;
+	slab_allocator->ctor = ctor;
+	slab_allocator->dtor = dtor;
+	// Free object must hold a pointer
+	if (align < _Alignof(void*)) {
+		align = _Alignof(void*);
+	}
+	if (ctor != NULL) {
+		slab_allocator->free_offset = (size + _Alignof(void*) - 1) / _Alignof(void*) * _Alignof(void*);
+		size = slab_allocator->free_offset + sizeof(void*);
+	} else {
+		slab_allocator->free_offset = 0;
+		if (size < sizeof(void*)) {
+			size = sizeof(void*);
+		}
+	}
+	slab_allocator->obj_shift = (size + align - 1) / align * align;
+	slab_allocator->color_next = 0;
+	slab_choose_order(slab_allocator);
+	list_init(&slab_allocator->full_head);
+	list_init(&slab_allocator->partial_head);
+	list_init(&slab_allocator->empty_head);
+	slab_allocator->empty_count = 0;
+	slab_allocator->empty_max = SLAB_EMPTY_MAX;
+	slab_allocator->use_magazines = use_magazines;
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		spin_init(&slab_allocator->magazines[cpu].lock);
+		slab_allocator->magazines[cpu].loaded = NULL;
+		slab_allocator->magazines[cpu].previous = NULL;
+	}
+	list_init(&slab_allocator->depot_full_head);
+	list_init(&slab_allocator->depot_empty_head);
+	slab_allocator->depot_full_count = 0;
+	slab_allocator->depot_empty_count = 0;
+	slab_allocator->allocs = 0;
+	slab_allocator->frees = 0;
+	slab_allocator->slabs = 0;
+	slab_allocator->objects_total = 0;
+	slab_allocator->grows = 0;
+	slab_allocator->shrinker.name = name;
+	slab_allocator->shrinker.count = slab_shrinker_count;
+	slab_allocator->shrinker.scan = slab_shrinker_scan;
+	shrinker_register(&slab_allocator->shrinker);
+	mutex_lock(&slab_allocators_lock);
+	list_add_tail(&slab_allocator->link, &slab_allocators_head);
+	mutex_unlock(&slab_allocators_lock);
+	struct slab* slab = slab_new(slab_allocator);
+	if (slab != NULL) {
+		log(LEVEL_V, "Slab allocator %s for size=%hu, align=%hu: order %d, %hu objects per slab.",
+				name, size, align, slab_allocator->order, slab->capacity);
+		list_add(&slab->link, &slab_allocator->empty_head);
+		++slab_allocator->empty_count;
+	}
+}
+
+void slab_init(struct slab_allocator* slab_allocator, const char* name, uint16_t size, uint16_t align) {
+	slab_init_raw(slab_allocator, name, size, align, NULL, NULL, true);
+}
+
+void slab_init_ctor(struct slab_allocator* slab_allocator, const char* name, uint16_t size, uint16_t align,
+		slab_ctor_t ctor, slab_dtor_t dtor) {
+	slab_init_raw(slab_allocator, name, size, align, ctor, dtor, true);
+}
+
+static void slab_depot_flush(struct slab_allocator* slab_allocator, struct list_node* head) {
+	while (!list_empty(head)) {
+		struct slab_magazine* magazine = LIST_ENTRY(list_first(head), struct slab_magazine, link);
+		list_delete(&magazine->link);
+		slab_magazine_flush(slab_allocator, magazine);
+		slab_free(magazine);
+	}
+}
+
+void slab_finit(struct slab_allocator* slab_allocator) {
+	// Noone uses it anymore, so magazines can be touched without locks
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		struct slab_magazine* loaded[] = {slab_allocator->magazines[cpu].loaded, slab_allocator->magazines[cpu].previous};
+		for (int i = 0; i != 2; ++i) {
+			if (loaded[i] != NULL) {
+				list_add(&loaded[i]->link, &slab_allocator->depot_full_head);
+			}
+		}
+	}
+	slab_depot_flush(slab_allocator, &slab_allocator->depot_full_head);
+	slab_depot_flush(slab_allocator, &slab_allocator->depot_empty_head);
+	slab_delete_all(&slab_allocator->full_head);
+	slab_delete_all(&slab_allocator->partial_head);
+	slab_delete_all(&slab_allocator->empty_head);
+	shrinker_unregister(&slab_allocator->shrinker);
+	mutex_lock(&slab_allocators_lock);
+	list_delete(&slab_allocator->link);
+	mutex_unlock(&slab_allocators_lock);
+	mutex_finit(&slab_allocator->lock);
+}
+
+void slab_set_empty_max(struct slab_allocator* slab_allocator, uint32_t empty_max) {
 	mutex_lock(&slab_allocator->lock);
-	void* res = __slab_alloc(slab_allocator);
+	slab_allocator->empty_max = empty_max;
+	while (slab_allocator->empty_count > slab_allocator->empty_max) {
+		struct slab* slab = LIST_ENTRY(list_first(&slab_allocator->empty_head), struct slab, link);
+		list_delete(&slab->link);
+		slab_delete(slab);
+		--slab_allocator->empty_count;
+	}
 	mutex_unlock(&slab_allocator->lock);
-	return res;
+}
+
+void* slab_alloc(struct slab_allocator* slab_allocator) {
+	void* ptr;
+	if (slab_allocator->use_magazines) {
+		struct slab_cpu_magazines* magazines = slab_this_magazines(slab_allocator);
+		uint64_t rflags = hard_spin_lock(&magazines->lock);
+		bool is_hit = slab_magazine_pop(magazines, &ptr);
+		hard_spin_unlock(&magazines->lock, rflags);
+		if (is_hit) {
+			slab_count(&slab_allocator->allocs, 1);
+			return ptr;
+		}
+		ptr = slab_alloc_slow(slab_allocator);
+	} else {
+		mutex_lock(&slab_allocator->lock);
+		ptr = __slab_alloc(slab_allocator);
+		mutex_unlock(&slab_allocator->lock);
+	}
+	if (ptr != NULL) {
+		slab_count(&slab_allocator->allocs, 1);
+	}
+	return ptr;
 }
 
 void slab_free(void* ptr) {
 	if (ptr == NULL) {
 		return;
 	}
-	phys_t ptr_phys = pa(ptr);
-	struct slab_allocator* slab_allocator = page_descr_for(ptr_phys)->slab_allocator;
+	// Slab is found by the page, no need to look through all of them
+	struct slab_allocator* slab_allocator = page_descr_for(pa(ptr))->slab->allocator;
+	slab_count(&slab_allocator->frees, 1);
+	if (slab_allocator->use_magazines) {
+		struct slab_cpu_magazines* magazines = slab_this_magazines(slab_allocator);
+		uint64_t rflags = hard_spin_lock(&magazines->lock);
+		bool is_hit = slab_magazine_push(magazines, ptr);
+		hard_spin_unlock(&magazines->lock, rflags);
+		if (!is_hit) {
+			slab_free_slow(slab_allocator, ptr);
+		}
+		return;
+	}
 	mutex_lock(&slab_allocator->lock);
-	for (
-			struct list_node* list_node = list_first(&slab_allocator->slabs_head);
-			list_node != &slab_allocator->slabs_head;
-			list_node = list_node->next
-	) {
-		struct slab* slab = LIST_ENTRY(list_node, struct slab, link);
-		if (slab->page <= ptr_phys && ptr_phys < slab->page + PAGE_SIZE) {
-			if (slab_allocator->obj_size <= SLAB_SMALL) {
-				slab_small_free(slab, ptr);
-			} else {
-				slab_big_free(slab, ptr);
-			}
-			break;
+	__slab_free(slab_allocator, ptr);
+	mutex_unlock(&slab_allocator->lock);
+}
+
+int slab_alloc_bulk(struct slab_allocator* slab_allocator, int count, void** ptrs) {
+	int allocated = 0;
+	if (slab_allocator->use_magazines) {
+		struct slab_cpu_magazines* magazines = slab_this_magazines(slab_allocator);
+		uint64_t rflags = hard_spin_lock(&magazines->lock);
+		while (allocated != count && slab_magazine_pop(magazines, &ptrs[allocated])) {
+			++allocated;
+		}
+		hard_spin_unlock(&magazines->lock, rflags);
+	}
+	if (allocated != count) {
+		mutex_lock(&slab_allocator->lock);
+		allocated += __slab_alloc_bulk(slab_allocator, count - allocated, ptrs + allocated);
+		mutex_unlock(&slab_allocator->lock);
+	}
+	slab_count(&slab_allocator->allocs, allocated);
+	return allocated;
+}
+
+void slab_free_bulk(struct slab_allocator* slab_allocator, int count, void** ptrs) {
+	int freed = 0;
+	if (slab_allocator->use_magazines) {
+		struct slab_cpu_magazines* magazines = slab_this_magazines(slab_allocator);
+		uint64_t rflags = hard_spin_lock(&magazines->lock);
+		while (freed != count && slab_magazine_push(magazines, ptrs[freed])) {
+			++freed;
+		}
+		hard_spin_unlock(&magazines->lock, rflags);
+	}
+	slab_count(&slab_allocator->frees, count);
+	if (freed != count) {
+		// Magazines are full, the rest goes straight to slabs
+		mutex_lock(&slab_allocator->lock);
+		for (; freed != count; ++freed) {
+			__slab_free(slab_allocator, ptrs[freed]);
+		}
+		mutex_unlock(&slab_allocator->lock);
+	}
+}
+
+void slab_get_stats(struct slab_allocator* slab_allocator, struct slab_stats* stats) {
+	stats->order = slab_allocator->order;
+	stats->objects_per_slab = slab_capacity(slab_allocator, slab_allocator->order);
+	uint64_t size = PAGE_SIZE << stats->order;
+	stats->waste_percent = (size - (uint64_t)stats->objects_per_slab * slab_allocator->obj_size) * 100 / size;
+	stats->colors = slab_colors(slab_allocator, slab_allocator->order);
+	struct list_node* heads[] = {&slab_allocator->full_head, &slab_allocator->partial_head, &slab_allocator->empty_head};
+	uint64_t* counts[] = {&stats->slabs_full, &stats->slabs_partial, &stats->slabs_empty};
+	stats->pages = 0;
+	stats->objects_active = 0;
+	stats->objects_cached = 0;
+	mutex_lock(&slab_allocator->lock);
+	for (int i = 0; i != 3; ++i) {
+		*counts[i] = 0;
+		for (struct list_node* node = list_first(heads[i]); node != heads[i]; node = node->next) {
+			struct slab* slab = LIST_ENTRY(node, struct slab, link);
+			++*counts[i];
+			stats->pages += 1ull << slab->order;
+			stats->objects_active += slab->in_use;
 		}
 	}
+	struct list_node* depot_heads[] = {&slab_allocator->depot_full_head, &slab_allocator->depot_empty_head};
+	for (int i = 0; i != 2; ++i) {
+		for (struct list_node* node = list_first(depot_heads[i]); node != depot_heads[i]; node = node->next) {
+			stats->objects_cached += LIST_ENTRY(node, struct slab_magazine, link)->rounds;
+		}
+	}
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		struct slab_cpu_magazines* magazines = &slab_allocator->magazines[cpu];
+		uint64_t rflags = hard_spin_lock(&magazines->lock);
+		if (magazines->loaded != NULL) {
+			stats->objects_cached += magazines->loaded->rounds;
+		}
+		if (magazines->previous != NULL) {
+			stats->objects_cached += magazines->previous->rounds;
+		}
+		hard_spin_unlock(&magazines->lock, rflags);
+	}
 	mutex_unlock(&slab_allocator->lock);
+	// Objects in magazines are free for us, but not for slabs
+	stats->objects_active -= stats->objects_cached;
+}
+
+// Counters are read without locks, so lines may be a bit off
+void slabinfo_report(slabinfo_out_t out, void* data) {
+	char line[160];
+	snprintf(line, sizeof(line), "%24s %8s %8s %5s %6s %5s %10s %10s %6s",
+			"name", "active", "total", "size", "slabs", "order", "allocs", "frees", "grows");
+	out(line, data);
+	mutex_lock(&slab_allocators_lock);
+	for (struct list_node* node = list_first(&slab_allocators_head); node != &slab_allocators_head; node = node->next) {
+		struct slab_allocator* slab_allocator = LIST_ENTRY(node, struct slab_allocator, link);
+		snprintf(line, sizeof(line), "%24s %8llu %8llu %5hu %6llu %5d %10llu %10llu %6llu",
+				slab_allocator->name, slab_allocator->allocs - slab_allocator->frees, slab_allocator->objects_total,
+				slab_allocator->obj_size, slab_allocator->slabs, slab_allocator->order,
+				slab_allocator->allocs, slab_allocator->frees, slab_allocator->grows);
+		out(line, data);
+	}
+	mutex_unlock(&slab_allocators_lock);
+}
+
+static void slabinfo_print(const char* line, void* data) {
+	printf("%s\n", line);
+}
+
+void slabinfo(void) {
+	slabinfo_report(slabinfo_print, NULL);
 }
@@ -3,38 +3,145 @@
 #include "memory.h"
 #include "threads.h"
 #include "list.h"
+#include "shrinker.h"
+#include "spinlock.h"
+#include "cpu.h"
 #include <stdint.h>
 
 struct slab;
-struct slab_node;
+struct slab_magazine;
 struct slab_allocator;
 
 #define SLAB_SMALL (PAGE_SIZE / 8)
+// Slabs take up to 2^SLAB_MAX_ORDER pages, bigger ones are used if smaller waste over 1/SLAB_WASTE_PART
+#define SLAB_MAX_ORDER 3
+#define SLAB_WASTE_PART 32
+// Empty slabs kept by default, others are returned to buddy
+#define SLAB_EMPTY_MAX 1
+// Slabs start objects at different offsets in steps of cache line, so they use different cache sets
+#define SLAB_COLOR_STEP 64
+// Objects in a magazine, so it takes 128 bytes
+#define SLAB_MAGAZINE_SIZE 13
+// Full or empty magazines kept in depot of an allocator
+#define SLAB_DEPOT_MAX 4
 
-struct slab_node {
-	struct list_node link;
-	void* data;
-} __attribute__((packed));
-
+// Kept at the end of slab's pages if there is room, otherwise taken from another allocator
 struct slab {
 	struct list_node link;
-	struct list_node nodes_head;
+	void* free_list;
 	phys_t page;
-} __attribute__((packed));
+	struct slab_allocator* allocator;
+	uint16_t in_use;
+	uint16_t capacity;
+	// Offset of the first object
+	uint16_t color;
+	uint8_t order;
+};
+
+typedef void (*slab_ctor_t)(void* obj);
+typedef void (*slab_dtor_t)(void* obj);
+
+struct slab_magazine {
+	struct list_node link;
+	int rounds;
+	void* objects[SLAB_MAGAZINE_SIZE];
+};
+
+// Magazine pair of one CPU, others take its lock only to flush or count
+struct slab_cpu_magazines {
+	struct spinlock lock;
+	struct slab_magazine* loaded;
+	struct slab_magazine* previous;
+};
 
 struct slab_allocator {
+	// In the list of all allocators
+	struct list_node link;
+	const char* name;
 	struct mutex lock;
-	struct list_node slabs_head;
+	struct list_node full_head;
+	struct list_node partial_head;
+	struct list_node empty_head;
+	uint32_t empty_count;
+	uint32_t empty_max;
 	uint16_t obj_size;
 	uint16_t obj_align;
+	// Distance between objects in a slab
+	uint16_t obj_shift;
+	// Chosen so that less memory is wasted
+	uint8_t order;
+	// Where free list pointer is stored in free objects
+	uint16_t free_offset;
+	// Color of the next slab
+	uint16_t color_next;
+	slab_ctor_t ctor;
+	slab_dtor_t dtor;
+
+	// Magazines to alloc & free without allocator lock, a pair for each CPU
+	bool use_magazines;
+	struct slab_cpu_magazines magazines[CPU_MAX];
+	struct list_node depot_full_head;
+	struct list_node depot_empty_head;
+	uint32_t depot_full_count;
+	uint32_t depot_empty_count;
+
+	// Gives empty slabs back when memory is short
+	struct shrinker shrinker;
+
+	// Counters for slabinfo. Objects handed out & taken back are counted atomically, as magazines are used.
+	uint64_t allocs;
+	uint64_t frees;
+	// Slabs are counted under allocator lock
+	uint64_t slabs;
+	uint64_t objects_total;
+	// Times buddy_alloc was called for a new slab
+	uint64_t grows;
+};
+
+struct slab_stats {
+	int order;
+	uint16_t objects_per_slab;
+	// Part of a slab not used for objects
+	int waste_percent;
+	// Different first object offsets
+	uint16_t colors;
+	uint64_t slabs_full;
+	uint64_t slabs_partial;
+	uint64_t slabs_empty;
+	uint64_t pages;
+	uint64_t objects_active;
+	// Free, but kept in magazines
+	uint64_t objects_cached;
 };
 
 void slab_allocators_init(void);
+// Off puts every new slab at color 0, for comparison
+void slab_set_coloring(bool is_enabled);
 
-void slab_init(struct slab_allocator* allocator, uint16_t size, uint16_t align);
+// Name is shown in slabinfo, it is not copied
+void slab_init(struct slab_allocator* allocator, const char* name, uint16_t size, uint16_t align);
+// Constructor runs once for each object when slab is created, destructor when it is deleted.
+// Objects must be freed in constructed state.
+void slab_init_ctor(struct slab_allocator* allocator, const char* name, uint16_t size, uint16_t align,
+		slab_ctor_t ctor, slab_dtor_t dtor);
 void slab_finit(struct slab_allocator* allocator);
+// How many empty slabs to keep for future allocations
+void slab_set_empty_max(struct slab_allocator* allocator, uint32_t empty_max);
 
 void* slab_alloc(struct slab_allocator* allocator);
 void slab_free(void* ptr);
+// Up to count objects, taking the lock once. Returns how many were allocated.
+int slab_alloc_bulk(struct slab_allocator* allocator, int count, void** ptrs);
+// All objects must be from this allocator
+void slab_free_bulk(struct slab_allocator* allocator, int count, void** ptrs);
+
+void slab_get_stats(struct slab_allocator* allocator, struct slab_stats* stats);
+
+// Report on all allocators, a line at a time (without '\n'), the first one is header
+typedef void (*slabinfo_out_t)(const char* line, void* data);
+void slabinfo_report(slabinfo_out_t out, void* data);
+// Prints the report
+void slabinfo(void);
 
-#define slab_init_for(p, type) slab_init(p, sizeof(type), _Alignof(type))
+#define slab_init_for(p, type) slab_init(p, #type, sizeof(type), _Alignof(type))
+#define slab_init_ctor_for(p, type, ctor, dtor) slab_init_ctor(p, #type, sizeof(type), _Alignof(type), ctor, dtor)
@@ -0,0 +1,149 @@
+#include "smp.h"
+#include "acpi.h"
+#include "lapic.h"
+#include "cpu.h"
+#include "memory.h"
+#include "paging.h"
+#include "buddy.h"
+#include "interrupt.h"
+#include "threads.h"
+#include "timer.h"
+#include "log.h"
+#include "utils.h"
+
+// INIT needs 10 ms, and AP has 100 ms to come up
+#define SMP_INIT_TICKS    10
+#define SMP_STARTUP_TICKS 1
+#define SMP_ONLINE_TICKS  100
+
+extern char smp_trampoline_begin[];
+extern char smp_trampoline_end[];
+extern char smp_trampoline_cr3[];
+extern char smp_trampoline_stack[];
+extern char smp_trampoline_cpu[];
+extern char smp_trampoline_entry[];
+
+static bool is_enabled = true;
+// Kernel's one, APs come with trampoline's (it maps low memory too)
+static phys_t smp_pml4;
+
+void smp_set_enabled(bool enabled) {
+	is_enabled = enabled;
+}
+
+static void smp_trampoline_set(char* field, uint64_t value) {
+	*(uint64_t*)((char*)va(SMP_TRAMPOLINE_BASE) + (field - smp_trampoline_begin)) = value;
+}
+
+static void smp_wait(uint64_t ticks) {
+	uint64_t end = timer_ticks() + ticks;
+	while (timer_ticks() < end) {
+		hlt();
+	}
+}
+
+// AP comes here from the trampoline, on its idle thread's stack
+static void smp_ap_main(struct cpu* cpu) {
+	store_pml4(smp_pml4);
+	cpu_init(cpu);
+	interrupt_load();
+	lapic_enable();
+	scheduler_init_cpu();
+	lapic_timer_start();
+	barrier();
+	cpu->is_online = true;
+	log(LEVEL_INFO, "CPU %d (APIC ID %u) is online.", cpu->id, cpu->apic_id);
+
+	interrupt_enable();
+	// Idle, as main on BSP
+	while (true) {
+		hlt();
+	}
+}
+
+static bool smp_start(struct cpu* cpu, phys_t stack_phys) {
+	void* stack = va(stack_phys);
+	scheduler_prepare_cpu(cpu->id, stack);
+	smp_trampoline_set(smp_trampoline_stack, (uint64_t)stack + THREAD_STACK_SIZE);
+	smp_trampoline_set(smp_trampoline_cpu, (uint64_t)cpu);
+
+	lapic_send_init(cpu->apic_id);
+	smp_wait(SMP_INIT_TICKS);
+	// Second one is for those who missed the first
+	for (int attempt = 0; attempt != 2 && !cpu->is_online; ++attempt) {
+		lapic_send_startup(cpu->apic_id, SMP_TRAMPOLINE_BASE);
+		smp_wait(SMP_STARTUP_TICKS);
+	}
+	uint64_t deadline = timer_ticks() + SMP_ONLINE_TICKS;
+	while (!cpu->is_online && timer_ticks() < deadline) {
+		hlt();
+	}
+	if (!cpu->is_online) {
+		// It may still come up later, so the stack is not freed
+		log(LEVEL_ERROR, "CPU %d (APIC ID %u) did not start.", cpu->id, cpu->apic_id);
+		return false;
+	}
+	return true;
+}
+
+void smp_init(void) {
+	struct acpi_cpus cpus;
+	if (!acpi_read_cpus(&cpus)) {
+		log(LEVEL_WARN, "Running on BSP only.");
+		return;
+	}
+	lapic_init(cpus.lapic_base);
+	lapic_enable();
+	struct cpu* bsp = cpu_current();
+	bsp->apic_id = lapic_id();
+	if (!is_enabled || cpus.count <= 1) {
+		log(LEVEL_INFO, "Running on BSP only (%d CPUs found).", cpus.count);
+		return;
+	}
+	lapic_timer_calibrate();
+
+	// Trampoline page tables: kernel's ones, and identity for the trampoline itself
+	smp_pml4 = load_pml4();
+	pte_t pml4 = paging_clone();
+	if (pte_phys(pml4) >= (1ull << 32)) {
+		log(LEVEL_ERROR, "Trampoline page tables are not in 32-bit memory, running on BSP only.");
+		buddy_free(pte_phys(pml4));
+		return;
+	}
+	paging_build_region(0, BIG_PAGE_SIZE, 0, pml4, 0);
+
+	char* trampoline = va(SMP_TRAMPOLINE_BASE);
+	for (char* pos = smp_trampoline_begin; pos != smp_trampoline_end; ++pos) {
+		trampoline[pos - smp_trampoline_begin] = *pos;
+	}
+	smp_trampoline_set(smp_trampoline_cr3, pte_phys(pml4));
+	smp_trampoline_set(smp_trampoline_entry, (uint64_t)smp_ap_main);
+
+	// Idle stacks of all APs at once
+	phys_t stacks[CPU_MAX];
+	int aps = min(cpus.count, CPU_MAX) - 1;
+	int stacks_count = buddy_alloc_bulk(THREAD_STACK_LEVEL, aps, stacks);
+	if (stacks_count != aps) {
+		log(LEVEL_ERROR, "No memory for stacks of %d APs.", aps - stacks_count);
+	}
+	int stacks_used = 0;
+	bool is_all_started = true;
+	for (int i = 0; i != cpus.count && stacks_used != stacks_count; ++i) {
+		if (cpus.apic_ids[i] == bsp->apic_id) {
+			continue;
+		}
+		struct cpu* cpu = cpu_add(cpus.apic_ids[i]);
+		if (cpu == NULL) {
+			break;
+		}
+		is_all_started &= smp_start(cpu, stacks[stacks_used++]);
+	}
+	buddy_free_bulk(stacks + stacks_used, stacks_count - stacks_used);
+	log(LEVEL_INFO, "%d CPUs are online.", cpu_count());
+	if (is_all_started) {
+		// Only PML4 and the identity part are trampoline's own, the rest is shared
+		phys_t pdpt = pte_phys(((pte_t*)va(pte_phys(pml4)))[0]);
+		phys_t tables[] = {pte_phys(((pte_t*)va(pdpt))[0]), pdpt, pte_phys(pml4)};
+		buddy_free_bulk(tables, 3);
+	}
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// Application processors start in real mode here, it must be free low memory
+#define SMP_TRAMPOLINE_BASE 0x8000
+
+#ifndef __ASM_FILE__
+
+#include <stdbool.h>
+
+// Called from cmdline, before smp_init
+void smp_set_enabled(bool is_enabled);
+// BSP with scheduler & PIT running: finds CPUs in MADT and starts them
+void smp_init(void);
+
+#endif /*__ASM_FILE__*/
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Busy-waiting lock for sections shared between CPUs, taken with interrupts off
+struct spinlock {
+	volatile uint32_t is_locked;
+};
+
+static inline void spin_init(struct spinlock* lock) {
+	lock->is_locked = 0;
+}
+
+static inline void spin_lock(struct spinlock* lock) {
+	while (__atomic_exchange_n(&lock->is_locked, 1, __ATOMIC_ACQUIRE)) {
+		// Only read while it's taken, so the cache line is not bounced around
+		while (lock->is_locked) {
+			asm volatile ("pause");
+		}
+	}
+}
+
+// Doesn't wait, false if it is taken already
+static inline bool spin_try_lock(struct spinlock* lock) {
+	return !lock->is_locked && !__atomic_exchange_n(&lock->is_locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(struct spinlock* lock) {
+	__atomic_store_n(&lock->is_locked, 0, __ATOMIC_RELEASE);
+}
@@ -57,3 +57,19 @@ void memcpy(void* dst, const void* src, uint64_t size) {
 		src_p++;
 	}
 }
+
+void memset(void* dst, uint8_t value, uint64_t size) {
+	char* dst_p = (char*) dst;
+
+	uint64_t value_l = value * 0x0101010101010101ull;
+	uint64_t longs = size / sizeof(uint64_t);
+	while (longs --> 0) {
+		*(uint64_t*) dst_p = value_l;
+		dst_p += sizeof(uint64_t);
+		size -= sizeof(uint64_t);
+	}
+	while (size --> 0) {
+		*dst_p = value;
+		dst_p++;
+	}
+}
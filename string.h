@@ -7,3 +7,4 @@ int strcmp(const char* a, const char* b);
 int strncmp(const char* a, const char* b, unsigned int n);
 char* strncpy(char* dst, const char* src, int n);
 void memcpy(void* dst, const void* src, uint64_t size);
+void memset(void* dst, uint8_t value, uint64_t size);
@@ -2,9 +2,110 @@
 #include "threads.h"
 #include "log.h"
 #include "print.h"
+#include "kmalloc.h"
+#include "slab-allocator.h"
+#include "fs.h"
+#include "memory.h"
+#include "utils.h"
+#include "timer.h"
+#include "cpu.h"
 
 #include <stddef.h>
 
+static void test_kmalloc_fill(uint8_t* ptr, size_t size, uint8_t pattern) {
+	for (size_t i = 0; i != size; ++i) {
+		ptr[i] = pattern + i;
+	}
+}
+
+static void test_kmalloc_check(uint8_t* ptr, size_t size, uint8_t pattern) {
+	for (size_t i = 0; i != size; ++i) {
+		if (ptr[i] != (uint8_t)(pattern + i)) {
+			halt("kmalloc'ed block %p was corrupted at %llu.", ptr, (uint64_t)i);
+		}
+	}
+}
+
+void test_kmalloc(void) {
+	log(LEVEL_INFO, "Starting kmalloc test...");
+
+	static const size_t sizes[] = {1, 8, 13, 100, 2048, 2049, 3 * PAGE_SIZE + 1};
+	const int count = sizeof(sizes) / sizeof(sizes[0]);
+	uint8_t* ptrs[sizeof(sizes) / sizeof(sizes[0])];
+	for (int i = 0; i != count; ++i) {
+		ptrs[i] = kmalloc(sizes[i], KMALLOC_ZERO);
+		if (ptrs[i] == NULL || ksize(ptrs[i]) < sizes[i]) {
+			halt("kmalloc(%llu) failed.", (uint64_t)sizes[i]);
+		}
+		for (size_t j = 0; j != sizes[i]; ++j) {
+			if (ptrs[i][j] != 0) {
+				halt("kmalloc(%llu, KMALLOC_ZERO) is not zeroed.", (uint64_t)sizes[i]);
+			}
+		}
+		test_kmalloc_fill(ptrs[i], sizes[i], i);
+	}
+	for (int i = 0; i != count; ++i) {
+		// Within size class block stays in place
+		if (krealloc(ptrs[i], ksize(ptrs[i]), 0) != ptrs[i]) {
+			halt("krealloc moved %p within its size class.", ptrs[i]);
+		}
+		uint8_t* moved = krealloc(ptrs[i], ksize(ptrs[i]) + 1, 0);
+		if (moved == NULL) {
+			halt("krealloc(%p) failed.", ptrs[i]);
+		}
+		test_kmalloc_check(moved, sizes[i], i);
+		ptrs[i] = moved;
+	}
+	for (int i = 0; i != count; ++i) {
+		kfree(ptrs[i]);
+	}
+
+	log(LEVEL_INFO, "kmalloc test completed.");
+}
+
+static void test_slabinfo_count(const char* line, void* data) {
+	++*(int*)data;
+}
+
+void test_slabinfo(void) {
+	log(LEVEL_INFO, "Starting slabinfo test...");
+
+	struct slab_allocator allocator;
+	slab_init(&allocator, "test", 100, 8);
+	void* ptrs[3];
+	for (int i = 0; i != 3; ++i) {
+		ptrs[i] = slab_alloc(&allocator);
+	}
+	slab_free(ptrs[0]);
+	if (allocator.allocs != 3 || allocator.frees != 1 || allocator.slabs != 1 || allocator.grows != 1) {
+		halt("Wrong counters of slab allocator: %llu allocs, %llu frees, %llu slabs, %llu grows.",
+				allocator.allocs, allocator.frees, allocator.slabs, allocator.grows);
+	}
+
+	// File has a line for each allocator, and the header
+	int lines = 0;
+	slabinfo_report(test_slabinfo_count, &lines);
+	struct file_desc* fd = open("/proc/slabinfo", 0);
+	if (fd == NULL) {
+		halt("No /proc/slabinfo.");
+	}
+	int file_lines = 0;
+	char c;
+	while (read(fd, &c, 1) == 1) {
+		file_lines += c == '\n';
+	}
+	close(fd);
+	if (file_lines != lines) {
+		halt("/proc/slabinfo has %d lines, %d expected.", file_lines, lines);
+	}
+
+	slab_free(ptrs[1]);
+	slab_free(ptrs[2]);
+	slab_finit(&allocator);
+
+	log(LEVEL_INFO, "slabinfo test completed.");
+}
+
 struct thread_test_data {
 	int level;
 	uint64_t id;
@@ -54,6 +155,141 @@ void test_threads(void) {
 	log(LEVEL_INFO, "Threads test completed.");
 }
 
+// Threads record the order they run in
+struct test_priority_data {
+	int order[3];
+	int count;
+};
+
+static struct test_priority_data test_priority_data;
+
+static void* test_priority_thread(void* p) {
+	uint64_t rflags = hard_lock();
+	test_priority_data.order[test_priority_data.count++] = (int)(uint64_t)p;
+	hard_unlock(rflags);
+	return NULL;
+}
+
+void test_priority(void) {
+	log(LEVEL_INFO, "Starting priority test...");
+	if (scheduler_get_class() != SCHEDULER_RR) {
+		log(LEVEL_INFO, "Priority test skipped, fair scheduling orders threads by virtual runtime.");
+		return;
+	}
+	if (cpu_count() > 1) {
+		log(LEVEL_INFO, "Priority test skipped, other CPUs run threads in parallel.");
+		return;
+	}
+	test_priority_data.count = 0;
+
+	// Nobody runs until all priorities are set. Idle (that's us) waits for them all in join.
+	uint64_t rflags = hard_lock();
+	struct thread* threads[3];
+	for (int i = 0; i != 3; ++i) {
+		threads[i] = thread_create(test_priority_thread, (void*)(uint64_t)i, "priority");
+		if (threads[i] == NULL) {
+			halt("Cannot create thread for priority test.");
+		}
+	}
+	// Created ones run newest first, priorities turn it around
+	thread_set_priority(threads[0], 0);
+	thread_set_priority(threads[2], THREAD_PRIORITY_DEFAULT + 1);
+	hard_unlock(rflags);
+	for (int i = 0; i != 3; ++i) {
+		thread_join(threads[i]);
+	}
+
+	static const int expected[] = {0, 1, 2};
+	for (int i = 0; i != 3; ++i) {
+		if (test_priority_data.order[i] != expected[i]) {
+			halt("Thread %d ran %d-th, but %d was expected.", test_priority_data.order[i], i, expected[i]);
+		}
+	}
+
+	log(LEVEL_INFO, "Priority test completed.");
+}
+
+// CPU hogs spin until the deadline, the first one gives CPU away often.
+// Each should get an equal share of CPU, how far they are from it is reported.
+// Fair class on one CPU must keep them all within the limit, giving CPU away does not lose the share.
+#define TEST_FAIRNESS_THREADS   4
+#define TEST_FAIRNESS_CYCLES    (2000ull * 1000 * 1000)
+#define TEST_FAIRNESS_DEVIATION 10
+
+static uint64_t test_fairness_deadline;
+
+static void* test_fairness_hog(void* p) {
+	bool is_yielding = p == NULL;
+	uint64_t iterations = 0;
+	while (rdtsc() < test_fairness_deadline) {
+		++iterations;
+		if (is_yielding && iterations % 1000 == 0) {
+			yield();
+		}
+	}
+	return NULL;
+}
+
+void test_fairness(void) {
+	log(LEVEL_INFO, "Starting fairness test...");
+
+	// Other CPUs may start hogs as soon as they are created
+	test_fairness_deadline = rdtsc() + TEST_FAIRNESS_CYCLES;
+	uint64_t rflags = hard_lock();
+	struct thread* threads[TEST_FAIRNESS_THREADS];
+	for (int i = 0; i != TEST_FAIRNESS_THREADS; ++i) {
+		threads[i] = thread_create(test_fairness_hog, (void*)(uint64_t)i, "hog");
+		if (threads[i] == NULL) {
+			halt("Cannot create thread for fairness test.");
+		}
+	}
+	hard_unlock(rflags);
+
+	// Other CPUs may still run hogs when we do, so wait for each. They are still here until joined.
+	for (int i = 0; i != TEST_FAIRNESS_THREADS; ++i) {
+		mutex_lock(&threads[i]->lock);
+		while (!threads[i]->is_over) {
+			cv_wait(&threads[i]->is_dead);
+		}
+		mutex_unlock(&threads[i]->lock);
+	}
+	// Last run of a hog is accounted by the time it is switched out
+	uint64_t runtimes[TEST_FAIRNESS_THREADS];
+	uint64_t total = 0;
+	for (int i = 0; i != TEST_FAIRNESS_THREADS; ++i) {
+		while (!__atomic_load_n(&threads[i]->is_switched_out, __ATOMIC_ACQUIRE)) {
+			yield();
+		}
+		runtimes[i] = threads[i]->runtime;
+		total += runtimes[i];
+	}
+	for (int i = 0; i != TEST_FAIRNESS_THREADS; ++i) {
+		thread_join(threads[i]);
+	}
+
+	uint64_t mean = total / TEST_FAIRNESS_THREADS;
+	uint64_t deviation = 0;
+	for (int i = 0; i != TEST_FAIRNESS_THREADS; ++i) {
+		if (runtimes[i] == 0) {
+			halt("Hog %d never ran.", i);
+		}
+		uint64_t diff = runtimes[i] > mean ? runtimes[i] - mean : mean - runtimes[i];
+		deviation = max_u64(deviation, diff);
+		log(LEVEL_INFO, "Hog %d%s: %llu cycles, %llu%% of fair share.", i, i == 0 ? " (yielding)" : "",
+				runtimes[i], runtimes[i] * 100 / mean);
+	}
+	uint64_t deviation_percent = deviation * 100 / mean;
+	if (scheduler_get_class() != SCHEDULER_FAIR) {
+		log(LEVEL_INFO, "Deviation is not checked, round-robin does not keep shares.");
+	} else if (cpu_count() > 1) {
+		// Threads are only moved to idle CPUs, queues may stay uneven
+		log(LEVEL_INFO, "Deviation is not checked, other CPUs run hogs in parallel.");
+	} else if (deviation_percent > TEST_FAIRNESS_DEVIATION) {
+		halt("Hogs are %llu%% away from fair share, at most %d%% is allowed.", deviation_percent, TEST_FAIRNESS_DEVIATION);
+	}
+	log(LEVEL_INFO, "Fairness test completed, max deviation from fair share is %llu%%.", deviation_percent);
+}
+
 struct test_cv_data {
 	struct mutex cs;
 	struct condition_variable cv;
@@ -79,19 +315,12 @@ static void* test_cv_waiter(void* p) {
 static void* test_cv_setter(void* p) {
 	struct test_cv_data* data = (struct test_cv_data*)p;
 	mutex_lock(&data->cs);
-	int a = 0;
-	for (int i = 0; i != 2000; ++i) {
-		for (int j = 0; j != 2000; ++j) {
-			for (int k = 0; k != 2000; ++k) {
-				a += i * 2 + j + k * 34;
-			}
-		}
-		if (i % 100 == 0) {
-			yield();
-		}
+	// Waiter has a chance to wake up wrongly meanwhile
+	for (int i = 0; i != 20; ++i) {
+		thread_sleep(10 * 1000 * 1000);
 	}
-	log(LEVEL_V, "Setting %d.", a);
-	data->is_set = a != 0;
+	log(LEVEL_V, "Setting.");
+	data->is_set = true;
 	cv_notify(&data->cv);
 	log(LEVEL_V, "Notified?");
 	mutex_unlock(&data->cs);
@@ -120,3 +349,75 @@ void test_condition_variable() {
 	mutex_finit(&data.cs);
 	log(LEVEL_INFO, "Condition variable test completed.");
 }
+
+// Runs in a thread, as idle one never sleeps
+
+#define TEST_TIMER_NS (20 * 1000 * 1000)
+
+struct test_timer_data {
+	struct mutex lock;
+	struct condition_variable cv;
+	bool is_set;
+};
+
+static void test_timer_check_elapsed(uint64_t start, const char* what) {
+	uint64_t elapsed = timer_ticks() - start;
+	if (elapsed < timer_ns_to_ticks(TEST_TIMER_NS)) {
+		halt("%s took %llu ticks only.", what, elapsed);
+	}
+	log(LEVEL_V, "%s took %llu ticks.", what, elapsed);
+}
+
+static void* test_timer_notifier(void* p) {
+	struct test_timer_data* data = (struct test_timer_data*)p;
+	thread_sleep(TEST_TIMER_NS);
+	mutex_lock(&data->lock);
+	data->is_set = true;
+	cv_notify(&data->cv);
+	mutex_unlock(&data->lock);
+	return NULL;
+}
+
+static void* test_timer_thread(void* p) {
+	uint64_t start = timer_ticks();
+	thread_sleep(TEST_TIMER_NS);
+	test_timer_check_elapsed(start, "thread_sleep");
+
+	struct test_timer_data data;
+	mutex_init(&data.lock);
+	cv_init(&data.cv, &data.lock);
+	data.is_set = false;
+
+	mutex_lock(&data.lock);
+	start = timer_ticks();
+	if (cv_wait_timeout(&data.cv, TEST_TIMER_NS)) {
+		halt("cv_wait_timeout returned without notify.");
+	}
+	test_timer_check_elapsed(start, "cv_wait_timeout");
+
+	struct thread* notifier = thread_create(test_timer_notifier, &data, "notifier");
+	if (notifier == NULL) {
+		halt("Cannot create thread for timer test.");
+	}
+	while (!data.is_set) {
+		if (!cv_wait_timeout(&data.cv, 100 * TEST_TIMER_NS)) {
+			halt("cv_wait_timeout missed notify.");
+		}
+	}
+	mutex_unlock(&data.lock);
+	thread_join(notifier);
+
+	cv_finit(&data.cv);
+	mutex_finit(&data.lock);
+	return NULL;
+}
+
+void test_timer(void) {
+	log(LEVEL_INFO, "Starting timer test...");
+	struct thread* thread = thread_create(test_timer_thread, NULL, "timer test");
+	if (thread == NULL) {
+		halt("Cannot create thread for timer test.");
+	}
+	thread_join(thread);
+	log(LEVEL_INFO, "Timer test completed.");
+}
@@ -1,4 +1,9 @@
 #pragma once
 
+void test_kmalloc(void);
+void test_slabinfo(void);
 void test_threads(void);
+void test_priority(void);
+void test_fairness(void);
 void test_condition_variable(void);
+void test_timer(void);
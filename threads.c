@@ -5,20 +5,60 @@
 #include "slab-allocator.h"
 #include "print.h"
 #include "log.h"
+#include "utils.h"
+#include "timer.h"
+#include "cpu.h"
+#include "lapic.h"
+#include "spinlock.h"
 
 // It's 2016
-// We don't care about SMP $)
+// Now we care about SMP: each CPU has its run queue, and takes threads from the busiest one when its own is empty.
+// Each run queue has its own spinlock, hard_lock is left for wait lists of condition variables and mutexes.
 // Either we care about sheduling done right
 
+struct run_queue;
+
+// Scheduling class decides which alive thread runs next
+struct scheduler_class {
+	const char* name;
+	void (*enqueue)(struct run_queue* queue, struct thread* thread, bool is_next);
+	void (*dequeue)(struct run_queue* queue, struct thread* thread);
+	struct thread* (*pick)(struct run_queue* queue);
+	// Dequeues a thread that may go to another CPU (not idle), NULL if there is none
+	struct thread* (*steal)(struct run_queue* queue);
+};
+
 // There always must be at least one alive thread (idle for example)
-static struct {
+struct run_queue {
+	// Held across the switch, the thread switched to releases it
+	struct spinlock lock;
+	int cpu;
 	struct thread idle;
 	struct thread* current;
-	struct list_node alive;
-	struct list_node sleep;
-	struct list_node dead;
+	// Run list for each priority
+	struct list_node alive[THREAD_PRIORITIES];
+	// Bit N is set iff run list of priority N is not empty
+	uint32_t alive_levels;
+	// Alive threads of fair class, by virtual runtime
+	struct avl_tree fair_tree;
+	// Virtual runtime of threads in the tree never goes below it for long
+	uint64_t min_vruntime;
+	// When current thread was switched to
+	uint64_t switch_tsc;
+	// Alive threads waiting for their turn, idle one is not counted
+	int queued;
+	// Switched out for good, it is marked so once its stack is not in use
+	struct thread* dead;
+};
+
+static struct {
+	const struct scheduler_class* class;
+	struct run_queue queues[CPU_MAX];
 } scheduler;
 static bool is_multithreaded = false;
+static enum scheduler_class_id scheduler_class_id = SCHEDULER_RR;
+// The one lock of hard_lock, nested on a CPU
+static struct spinlock hard_spinlock;
 
 static void thread_fictive_init(struct thread* thread) {
 	list_init(&thread->scheduler_link);
@@ -26,17 +66,280 @@ static void thread_fictive_init(struct thread* thread) {
 	thread->name = "FICTIVE";
 }
 
+// Everything here is under the lock of the queue.
+
+static struct run_queue* this_queue(void) {
+	return &scheduler.queues[cpu_current()->id];
+}
+
+// Interrupts go off first, so the CPU stays the same
+static struct run_queue* this_queue_lock(uint64_t* rflags) {
+	*rflags = read_rflags();
+	interrupt_disable();
+	struct run_queue* queue = this_queue();
+	spin_lock(&queue->lock);
+	return queue;
+}
+
+// Thread may move to another queue until its current one is locked
+static struct run_queue* thread_queue_lock(struct thread* thread, uint64_t* rflags) {
+	while (true) {
+		struct run_queue* queue = __atomic_load_n(&thread->queue, __ATOMIC_RELAXED);
+		*rflags = hard_spin_lock(&queue->lock);
+		if (thread->queue == queue) {
+			return queue;
+		}
+		hard_spin_unlock(&queue->lock, *rflags);
+	}
+}
+
+// Round-robin: run lists, the highest priority one goes first.
+// Threads are added to the head to run next, or to the tail to wait for their turn.
+
+static void rr_enqueue(struct run_queue* queue, struct thread* thread, bool is_next) {
+	struct list_node* head = &queue->alive[thread->priority];
+	if (is_next) {
+		list_add(&thread->scheduler_link, head);
+	} else {
+		list_add_tail(&thread->scheduler_link, head);
+	}
+	queue->alive_levels |= 1u << thread->priority;
+}
+
+static void rr_dequeue(struct run_queue* queue, struct thread* thread) {
+	list_delete(&thread->scheduler_link);
+	if (list_empty(&queue->alive[thread->priority])) {
+		queue->alive_levels &= ~(1u << thread->priority);
+	}
+}
+
+// First thread of the highest non-empty level
+static struct thread* rr_pick(struct run_queue* queue) {
+	if (queue->alive_levels == 0) {
+		return NULL;
+	}
+	int priority = __builtin_ctz(queue->alive_levels);
+	struct thread* thread = LIST_ENTRY(list_first(&queue->alive[priority]), struct thread, scheduler_link);
+	rr_dequeue(queue, thread);
+	return thread;
+}
+
+// The one that would run first, but idle
+static struct thread* rr_steal(struct run_queue* queue) {
+	for (uint32_t levels = queue->alive_levels; levels != 0; levels &= levels - 1) {
+		struct list_node* head = &queue->alive[__builtin_ctz(levels)];
+		for (struct list_node* node = head->next; node != head; node = node->next) {
+			struct thread* thread = LIST_ENTRY(node, struct thread, scheduler_link);
+			if (!thread->is_idle) {
+				rr_dequeue(queue, thread);
+				return thread;
+			}
+		}
+	}
+	return NULL;
+}
+
+static const struct scheduler_class rr_class = {
+	.name = "round-robin",
+	.enqueue = rr_enqueue,
+	.dequeue = rr_dequeue,
+	.pick = rr_pick,
+	.steal = rr_steal
+};
+
+// Fair: thread with the least virtual runtime goes first. Virtual runtime grows slower for heavier threads.
+// Idle priority is not in the tree, those threads are round-robin when the tree is empty.
+
+// Each priority is 1.25 times heavier than the next one, idle is barely there
+static const uint64_t fair_weights[THREAD_PRIORITIES] = {
+	2000, 1600, 1280, 1024, 819, 655, 524, 3
+};
+
+static bool fair_less(struct avl_node* a, struct avl_node* b) {
+	return AVL_ENTRY(a, struct thread, scheduler_node)->vruntime < AVL_ENTRY(b, struct thread, scheduler_node)->vruntime;
+}
+
+static void fair_enqueue(struct run_queue* queue, struct thread* thread, bool is_next) {
+	if (thread->priority == THREAD_PRIORITY_IDLE) {
+		rr_enqueue(queue, thread, is_next);
+		return;
+	}
+	avl_insert(&queue->fair_tree, &thread->scheduler_node);
+}
+
+static void fair_dequeue(struct run_queue* queue, struct thread* thread) {
+	if (thread->priority == THREAD_PRIORITY_IDLE) {
+		rr_dequeue(queue, thread);
+		return;
+	}
+	avl_delete(&queue->fair_tree, &thread->scheduler_node);
+}
+
+static struct thread* fair_pick(struct run_queue* queue) {
+	if (avl_empty(&queue->fair_tree)) {
+		return rr_pick(queue);
+	}
+	struct thread* thread = AVL_ENTRY(avl_first(&queue->fair_tree), struct thread, scheduler_node);
+	avl_delete(&queue->fair_tree, &thread->scheduler_node);
+	queue->min_vruntime = max_u64(queue->min_vruntime, thread->vruntime);
+	return thread;
+}
+
+// Idle threads are never in the tree
+static struct thread* fair_steal(struct run_queue* queue) {
+	if (avl_empty(&queue->fair_tree)) {
+		return rr_steal(queue);
+	}
+	struct thread* thread = AVL_ENTRY(avl_first(&queue->fair_tree), struct thread, scheduler_node);
+	avl_delete(&queue->fair_tree, &thread->scheduler_node);
+	return thread;
+}
+
+static const struct scheduler_class fair_class = {
+	.name = "fair",
+	.enqueue = fair_enqueue,
+	.dequeue = fair_dequeue,
+	.pick = fair_pick,
+	.steal = fair_steal
+};
+
+static void scheduler_enqueue(struct run_queue* queue, struct thread* thread, bool is_next) {
+	scheduler.class->enqueue(queue, thread, is_next);
+	thread->queue = queue;
+	thread->is_queued = true;
+	queue->queued += !thread->is_idle;
+}
+
+static void scheduler_dequeue(struct thread* thread) {
+	struct run_queue* queue = thread->queue;
+	scheduler.class->dequeue(queue, thread);
+	thread->is_queued = false;
+	queue->queued -= !thread->is_idle;
+}
+
+static struct thread* scheduler_pick(struct run_queue* queue) {
+	struct thread* thread = scheduler.class->pick(queue);
+	if (thread == NULL) {
+		halt("There is no alive threads!");
+	}
+	thread->is_queued = false;
+	queue->queued -= !thread->is_idle;
+	return thread;
+}
+
+// Empty queue takes a thread from the one with the most waiting.
+// Virtual runtime is moved from one queue's scale to another's.
+// Counts are read unlocked, and a busy lock is skipped: its owner may be stealing from us.
+static void scheduler_steal(struct run_queue* queue) {
+	struct run_queue* busiest = NULL;
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		struct run_queue* other = &scheduler.queues[cpu];
+		if (other != queue && other->queued != 0 && (busiest == NULL || other->queued > busiest->queued)) {
+			busiest = other;
+		}
+	}
+	if (busiest == NULL || !spin_try_lock(&busiest->lock)) {
+		return;
+	}
+	struct thread* thread = scheduler.class->steal(busiest);
+	if (thread == NULL) {
+		spin_unlock(&busiest->lock);
+		return;
+	}
+	thread->is_queued = false;
+	--busiest->queued;
+	uint64_t lag = thread->vruntime - min_u64(thread->vruntime, busiest->min_vruntime);
+	thread->vruntime = queue->min_vruntime + lag;
+	log(LEVEL_VV, "Thread %s moves from CPU %d to CPU %d.", thread->name, busiest->cpu, queue->cpu);
+	scheduler_enqueue(queue, thread, false);
+	spin_unlock(&busiest->lock);
+}
+
+// Woken threads get up to SCHEDULER_SLEEPER_CREDIT ahead of others, but not more, whatever they slept.
+// They go back to the CPU they ran on, true if it has to be kicked out of idle.
+static bool scheduler_wake(struct run_queue* queue, struct thread* thread) {
+	if (queue->min_vruntime > SCHEDULER_SLEEPER_CREDIT) {
+		thread->vruntime = max_u64(thread->vruntime, queue->min_vruntime - SCHEDULER_SLEEPER_CREDIT);
+	}
+	scheduler_enqueue(queue, thread, true);
+	return queue != this_queue() && queue->current->is_idle;
+}
+
+// Time since the last switch goes to the current thread
+static void scheduler_account(struct run_queue* queue, struct thread* thread) {
+	uint64_t now = rdtsc();
+	uint64_t delta = now - queue->switch_tsc;
+	queue->switch_tsc = now;
+	thread->runtime += delta;
+	thread->vruntime += delta * fair_weights[THREAD_PRIORITY_DEFAULT] / fair_weights[thread->priority];
+}
+
+// Thread switched to releases the queue of its CPU, which the previous one locked
+static void scheduler_finish_switch(void) {
+	struct run_queue* queue = this_queue();
+	if (queue->dead != NULL) {
+		__atomic_store_n(&queue->dead->is_switched_out, true, __ATOMIC_RELEASE);
+		queue->dead = NULL;
+	}
+	spin_unlock(&queue->lock);
+}
+
+void scheduler_set_class(enum scheduler_class_id id) {
+	scheduler_class_id = id;
+}
+
+enum scheduler_class_id scheduler_get_class(void) {
+	return scheduler_class_id;
+}
+
 // Locks
 
+// Interrupts are off while it is held, so depth of the CPU is of the running thread
 uint64_t hard_lock() {
 	uint64_t rflags = read_rflags();
 	interrupt_disable();
+	struct cpu* cpu = cpu_current();
+	if (cpu->lock_depth++ == 0) {
+		spin_lock(&hard_spinlock);
+	}
 	barrier();
 	return rflags;
 }
 
 void hard_unlock(uint64_t rflags) {
 	barrier();
+	struct cpu* cpu = cpu_current();
+	if (--cpu->lock_depth == 0) {
+		spin_unlock(&hard_spinlock);
+	}
+	write_rflags(rflags);
+}
+
+// Sleeping thread lets it go whatever the depth, and takes it back to the same depth, maybe on another CPU
+static int hard_lock_drop(void) {
+	struct cpu* cpu = cpu_current();
+	int depth = cpu->lock_depth;
+	cpu->lock_depth = 0;
+	barrier();
+	spin_unlock(&hard_spinlock);
+	return depth;
+}
+
+static void hard_lock_retake(int depth) {
+	spin_lock(&hard_spinlock);
+	barrier();
+	cpu_current()->lock_depth = depth;
+}
+
+uint64_t hard_spin_lock(struct spinlock* lock) {
+	uint64_t rflags = read_rflags();
+	interrupt_disable();
+	spin_lock(lock);
+	return rflags;
+}
+
+void hard_spin_unlock(struct spinlock* lock, uint64_t rflags) {
+	spin_unlock(lock);
 	write_rflags(rflags);
 }
 
@@ -48,25 +351,56 @@ void cv_init(struct condition_variable* variable, struct mutex* mutex) {
 void cv_finit(struct condition_variable* variable) {
 }
 
-void cv_wait(struct condition_variable* variable) {
+// Sleep -> alive, thread must be out of condition variable list already.
+// It may not have switched out yet: then it just doesn't, schedule sees the flag cleared.
+static void thread_wake(struct thread* thread) {
+	uint64_t rflags;
+	struct run_queue* queue = thread_queue_lock(thread, &rflags);
+	bool should_kick = false;
+	if (thread->is_sleeping) {
+		thread->is_sleeping = false;
+		if (queue->current != thread && !thread->is_queued) {
+			should_kick = scheduler_wake(queue, thread);
+		}
+	}
+	hard_spin_unlock(&queue->lock, rflags);
+	if (should_kick) {
+		lapic_send_ipi(cpu_get(queue->cpu)->apic_id, INTERRUPT_RESCHEDULE);
+	}
+}
+
+// Timer is started once thread is in the list, so it can't fire before.
+// Interrupts stay off until the switch, so the sleeping thread is not preempted as alive.
+static void __cv_wait(struct condition_variable* variable, struct timer* timer, uint64_t ticks) {
 	uint64_t rflags = hard_lock();
 	struct thread* current = thread_current();
 	// idle thread does not sleeps!
-	bool can_sleep = current != &scheduler.idle;
+	bool can_sleep = !current->is_idle;
 	bool should_release = variable != &variable->mutex->is_locked;
 	if (can_sleep) {
 		list_add(&current->store_link, &variable->threads_head);
+		current->is_sleeping = true;
+		if (timer != NULL) {
+			timer_add(timer, ticks);
+		}
 	}
 	// If that variable is not for locking, release...
 	if (should_release) {
 		mutex_unlock(variable->mutex);
 	}
+	int depth = hard_lock_drop();
 	if (can_sleep) {
 		// Alive -> sleep
 		schedule(THREAD_NEW_STATE_SLEEP);
 	} else {
 		schedule(THREAD_NEW_STATE_ALIVE);
 	}
+	// Before the mutex: waiting for it puts us on its list, and the timer must not take us from there.
+	// Not under hard_lock, the timer may be firing and waiting for it.
+	if (timer != NULL) {
+		timer_cancel(timer);
+	}
+	hard_lock_retake(depth);
 	// ..and take back here.
 	if (should_release) {
 		mutex_lock(variable->mutex);
@@ -74,6 +408,43 @@ void cv_wait(struct condition_variable* variable) {
 	hard_unlock(rflags);
 }
 
+void cv_wait(struct condition_variable* variable) {
+	__cv_wait(variable, NULL, 0);
+}
+
+struct cv_timeout {
+	struct timer timer;
+	struct thread* thread;
+	bool is_timed_out;
+};
+
+static void cv_timeout_fire(struct timer* timer) {
+	struct cv_timeout* timeout = (struct cv_timeout*) timer->data;
+	uint64_t rflags = hard_lock();
+	// Not notified yet
+	if (!list_empty(&timeout->thread->store_link)) {
+		list_delete(&timeout->thread->store_link);
+		timeout->is_timed_out = true;
+		thread_wake(timeout->thread);
+	}
+	hard_unlock(rflags);
+}
+
+bool cv_wait_timeout(struct condition_variable* variable, uint64_t ns) {
+	uint64_t ticks = timer_ns_to_ticks(ns);
+	uint64_t deadline = timer_ticks() + ticks;
+	struct cv_timeout timeout;
+	timer_init(&timeout.timer, cv_timeout_fire, &timeout);
+	timeout.thread = thread_current();
+	timeout.is_timed_out = false;
+	__cv_wait(variable, &timeout.timer, ticks);
+	if (timeout.thread->is_idle) {
+		// It did not sleep, others just had a chance to run
+		return timer_ticks() < deadline;
+	}
+	return !timeout.is_timed_out;
+}
+
 static void __cv_notify(struct condition_variable* variable, struct thread* wake_up) {
 	if (wake_up == NULL) {
 		log(LEVEL_VVV, "Noone to notify! %p.", variable);
@@ -82,8 +453,7 @@ static void __cv_notify(struct condition_variable* variable, struct thread* wake
 	log(LEVEL_VVV, "Notified %s.", wake_up->name);
 	list_delete(&wake_up->store_link);
 	// Sleep -> alive
-	list_delete(&wake_up->scheduler_link);
-	list_add(&wake_up->scheduler_link, &scheduler.alive);
+	thread_wake(wake_up);
 }
 
 void cv_notify(struct condition_variable* variable) {
@@ -124,6 +494,17 @@ void mutex_lock(struct mutex* mutex) {
 	hard_unlock(rflags);
 }
 
+bool mutex_try_lock(struct mutex* mutex) {
+	uint64_t rflags = hard_lock();
+	bool result = true;
+	if (is_multithreaded) {
+		result = !mutex->is_occupied;
+		mutex->is_occupied = true;
+	}
+	hard_unlock(rflags);
+	return result;
+}
+
 void mutex_unlock(struct mutex* mutex) {
 	uint64_t rflags = hard_lock();
 	if (is_multithreaded) {
@@ -135,50 +516,118 @@ void mutex_unlock(struct mutex* mutex) {
 
 static struct slab_allocator thread_allocator;
 
+static void thread_ctor(struct thread* thread) {
+	mutex_init(&thread->lock);
+	cv_init(&thread->is_dead, &thread->lock);
+	list_init(&thread->scheduler_link);
+	list_init(&thread->store_link);
+	thread->is_queued = false;
+	thread->is_idle = false;
+	thread->is_sleeping = false;
+}
+
+static void thread_dtor(struct thread* thread) {
+	cv_finit(&thread->is_dead);
+	mutex_finit(&thread->lock);
+}
+
 extern char init_stack[];
 
+static void run_queue_init(struct run_queue* queue, int cpu) {
+	spin_init(&queue->lock);
+	queue->cpu = cpu;
+	queue->current = NULL;
+	for (int priority = 0; priority != THREAD_PRIORITIES; ++priority) {
+		list_init(&queue->alive[priority]);
+	}
+	queue->alive_levels = 0;
+	avl_init(&queue->fair_tree, fair_less);
+	queue->min_vruntime = 0;
+	queue->queued = 0;
+	queue->dead = NULL;
+}
+
+// Code that runs on CPU before scheduler becomes its idle thread
+static void idle_init(struct thread* idle, const char* name, void* stack) {
+	mutex_init(&idle->lock);
+	cv_init(&idle->is_dead, &idle->lock);
+	idle->name = name;
+	idle->priority = THREAD_PRIORITY_IDLE;
+	idle->is_queued = false;
+	idle->is_idle = true;
+	idle->is_sleeping = false;
+	idle->vruntime = 0;
+	idle->runtime = 0;
+	list_init(&idle->scheduler_link);
+	list_init(&idle->store_link);
+	idle->stack = stack;
+}
+
 void scheduler_init(void) {
-	slab_init_for(&thread_allocator, struct thread);
-	list_init(&scheduler.alive);
-	list_init(&scheduler.sleep);
-	list_init(&scheduler.dead);
-
-	struct thread* main = &scheduler.idle;
-	mutex_init(&main->lock);
-	cv_init(&main->is_dead, &main->lock);
-	main->name = "main (idle)";
-	list_init(&main->scheduler_link);
-	list_init(&main->store_link);
-	main->stack = init_stack;
-	scheduler.current = main;
+	slab_init_ctor_for(&thread_allocator, struct thread, (slab_ctor_t)thread_ctor, (slab_dtor_t)thread_dtor);
+	spin_init(&hard_spinlock);
+	for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+		run_queue_init(&scheduler.queues[cpu], cpu);
+	}
+	scheduler.class = scheduler_class_id == SCHEDULER_FAIR ? &fair_class : &rr_class;
+	log(LEVEL_INFO, "Scheduling is %s.", scheduler.class->name);
+
+	struct run_queue* queue = this_queue();
+	idle_init(&queue->idle, "main (idle)", init_stack);
+	queue->idle.queue = queue;
+	queue->current = &queue->idle;
+	queue->switch_tsc = rdtsc();
 
 	is_multithreaded = true;
 }
 
+static const char* idle_names[CPU_MAX] = {
+	"main (idle)", "idle 1", "idle 2", "idle 3", "idle 4", "idle 5", "idle 6", "idle 7"
+};
+
+void scheduler_prepare_cpu(int cpu, void* stack) {
+	struct run_queue* queue = &scheduler.queues[cpu];
+	idle_init(&queue->idle, idle_names[cpu], stack);
+	queue->idle.queue = queue;
+}
+
+void scheduler_init_cpu(void) {
+	uint64_t rflags;
+	struct run_queue* queue = this_queue_lock(&rflags);
+	queue->current = &queue->idle;
+	queue->switch_tsc = rdtsc();
+	hard_spin_unlock(&queue->lock, rflags);
+}
+
+// Interrupts are off, so it can't move to another CPU meanwhile
 struct thread* thread_current(void) {
-	return scheduler.current;
+	uint64_t rflags = read_rflags();
+	interrupt_disable();
+	struct thread* current = this_queue()->current;
+	write_rflags(rflags);
+	return current;
 }
 
 struct thread* thread_create(thread_func_t func, void* data, const char* name) {
-	phys_t stack_phys = buddy_alloc(THREAD_STACK_ORDER);
+	phys_t stack_phys = buddy_alloc_pages(THREAD_STACK_PAGES);
 	if (stack_phys == (phys_t)NULL)	{
 		return NULL;
 	}
 	struct thread* thread = (struct thread*) slab_alloc(&thread_allocator);
 	if (thread == NULL) {
-		buddy_free(stack_phys);
+		buddy_free_pages(stack_phys, THREAD_STACK_PAGES);
 		return NULL;
 	}
-	mutex_init(&thread->lock);
-	cv_init(&thread->is_dead, &thread->lock);
+	// Lock, condition variable & links are constructed by slab
 	thread->func = func;
 	thread->data = data;
 	thread->is_over = false;
 	thread->name = name;
+	thread->priority = THREAD_PRIORITY_DEFAULT;
+	thread->runtime = 0;
+	thread->is_switched_out = false;
 
 	thread->stack = va(stack_phys);
-	list_init(&thread->scheduler_link);
-	list_init(&thread->store_link);
 
 	uint64_t* stack_top = (uint64_t*)((virt_t)thread->stack + THREAD_STACK_SIZE);
 
@@ -201,10 +650,12 @@ struct thread* thread_create(thread_func_t func, void* data, const char* name) {
 	stack_push(0); // R15
 	thread->stack_pointer = stack_top;
 
-	// Scheduler must be hard-locked
-	uint64_t rflags = hard_lock();
-	list_add(&thread->scheduler_link, &scheduler.alive);
-	hard_unlock(rflags);
+	uint64_t rflags;
+	struct run_queue* queue = this_queue_lock(&rflags);
+	// Starts level with others, not ahead of them
+	thread->vruntime = queue->min_vruntime;
+	scheduler_enqueue(queue, thread, true);
+	hard_spin_unlock(&queue->lock, rflags);
 	return thread;
 }
 
@@ -212,14 +663,13 @@ void thread_run(struct thread* thread) {
 	thread_func_t func = thread->func;
 	void* data = thread->data;
 
-	// Thread is created with disabled interrupts
+	// Thread is created with disabled interrupts, and comes here from schedule with the queue locked
+	scheduler_finish_switch();
 	interrupt_enable();
 	log(LEVEL_VV, "Starting thread %s.", thread->name);
 
 	data = func((void*) data);
 
-	uint64_t rflags = hard_lock();
-
 	mutex_lock(&thread->lock);
 	thread->is_over = true;
 	thread->data = data;
@@ -227,7 +677,6 @@ void thread_run(struct thread* thread) {
 	mutex_unlock(&thread->lock);
 
 	schedule(THREAD_NEW_STATE_DEAD);
-	hard_unlock(rflags);
 	halt("Scheduler activated dead thread %s!", thread->name);
 }
 
@@ -239,50 +688,127 @@ void* thread_join(struct thread* thread) {
 	
 	void* data = (void*) thread->data;
 	mutex_unlock(&thread->lock);
+	// It may still be on its way out, on its own stack
+	while (!__atomic_load_n(&thread->is_switched_out, __ATOMIC_ACQUIRE)) {
+		yield();
+	}
 	log(LEVEL_VV, "Deleting dead thread %s.", thread->name);
 
-	uint64_t rflags = hard_lock();
-	list_delete(&thread->scheduler_link);
-	cv_finit(&thread->is_dead);
-	mutex_finit(&thread->lock);
-	buddy_free(pa(thread->stack));
+	buddy_free_pages(pa(thread->stack), THREAD_STACK_PAGES);
 	slab_free(thread);
-	hard_unlock(rflags);
 	
 	return data;
 }
 
+static void thread_sleep_fire(struct timer* timer) {
+	thread_wake((struct thread*) timer->data);
+}
+
+void thread_sleep(uint64_t ns) {
+	uint64_t ticks = timer_ns_to_ticks(ns);
+	struct thread* current = thread_current();
+	if (current->is_idle) {
+		// Idle can't sleep, others run meanwhile
+		uint64_t deadline = timer_ticks() + ticks;
+		while (timer_ticks() < deadline) {
+			yield();
+		}
+		return;
+	}
+	struct timer timer;
+	timer_init(&timer, thread_sleep_fire, current);
+	// Not preempted as alive before it sleeps
+	uint64_t rflags = read_rflags();
+	interrupt_disable();
+	current->is_sleeping = true;
+	timer_add(&timer, ticks);
+	schedule(THREAD_NEW_STATE_SLEEP);
+	// Woken by the timer, but it may be still returning
+	timer_cancel(&timer);
+	write_rflags(rflags);
+}
+
+void thread_set_priority(struct thread* thread, int priority) {
+	if (priority < 0 || priority >= THREAD_PRIORITIES) {
+		halt("Wrong priority %d for thread %s.", priority, thread->name);
+	}
+	if (thread->is_idle) {
+		log(LEVEL_WARN, "Idle thread stays at the lowest priority.");
+		return;
+	}
+	uint64_t rflags;
+	struct run_queue* queue = thread_queue_lock(thread, &rflags);
+	if (thread->is_queued) {
+		scheduler_dequeue(thread);
+		thread->priority = priority;
+		scheduler_enqueue(queue, thread, false);
+	} else {
+		thread->priority = priority;
+	}
+	hard_spin_unlock(&queue->lock, rflags);
+}
+
+// Queue stays locked across the switch: thread enqueued here is still on its stack until then
 void schedule(enum thread_new_state state) {
-	uint64_t rflags = hard_lock();
-	struct thread* current = scheduler.current;
+	uint64_t rflags = read_rflags();
+	interrupt_disable();
+	if (cpu_current()->lock_depth != 0) {
+		halt("Switching under hard_lock.");
+	}
+	struct run_queue* queue = this_queue();
+	spin_lock(&queue->lock);
+	struct thread* current = queue->current;
+	scheduler_account(queue, current);
 	switch (state) {
 		case THREAD_NEW_STATE_ALIVE:
-			list_add_tail(&current->scheduler_link, &scheduler.alive);
+			scheduler_enqueue(queue, current, false);
 			break;
 		case THREAD_NEW_STATE_SLEEP:
-			list_add(&current->scheduler_link, &scheduler.sleep);
+			// Woken already, before it switched out
+			if (!current->is_sleeping) {
+				scheduler_enqueue(queue, current, false);
+			}
 			break;
 		case THREAD_NEW_STATE_DEAD:
-			list_add(&current->scheduler_link, &scheduler.dead);
+			queue->dead = current;
 			break;
 	}
-	// Get new task from beginning of alive threads...
-	if (list_empty(&scheduler.alive)) {
-		halt("There is no alive threads!");
+	if (queue->queued == 0) {
+		scheduler_steal(queue);
 	}
-	struct thread* target = LIST_ENTRY(list_first(&scheduler.alive), struct thread, scheduler_link);
-	list_delete(&target->scheduler_link);
+	// Get new task chosen by scheduling class...
+	struct thread* target = scheduler_pick(queue);
 
-	scheduler.current = target;
+	queue->current = target;
 
 	log(LEVEL_VV, "Initiate switching %s -> %s...", current->name, target->name);
 	if (current == target) {
-		log(LEVEL_WARN, "Oh, there are the same! Not switching...");
+		// Usual for fair class, yielding thread may still have the least virtual runtime
+		log(LEVEL_VV, "Oh, there are the same! Not switching...");
 	} else {
 		thread_switch(&current->stack_pointer, target->stack_pointer);
-		log(LEVEL_VV, "Switched to %s.", scheduler.current->name);
+		// Back, maybe on another CPU
+		log(LEVEL_VV, "Switched to %s.", current->name);
 	}
-	hard_unlock(rflags);
+	scheduler_finish_switch();
+	write_rflags(rflags);
+}
+
+bool scheduler_is_alone(void) {
+	uint64_t rflags;
+	struct run_queue* queue = this_queue_lock(&rflags);
+	bool is_alone = queue->queued == 0;
+	bool is_idle = queue->current->is_idle;
+	hard_spin_unlock(&queue->lock, rflags);
+	// Idle may take a thread from others, their counts are just a hint
+	if (is_alone && is_idle) {
+		for (int cpu = 0; cpu != CPU_MAX; ++cpu) {
+			if (__atomic_load_n(&scheduler.queues[cpu].queued, __ATOMIC_RELAXED) != 0) {
+				return false;
+			}
+		}
+	}
+	return is_alone;
 }
 
 void yield(void) {
@@ -1,11 +1,14 @@
 #pragma once
 
-#define THREAD_STACK_ORDER 1
+#define THREAD_STACK_PAGES 2
+// Buddy level of a stack, THREAD_STACK_PAGES is its power of two
+#define THREAD_STACK_LEVEL 1
 #define THREAD_STACK_SIZE 0x2000
 
 #ifndef __ASM_FILE__
 
 #include "list.h"
+#include "avl.h"
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -15,7 +18,15 @@ static inline void barrier() {
 
 typedef void* (*thread_func_t)(void*);
 
+// Priority levels, 0 is the highest. Each level has its own run list.
+#define THREAD_PRIORITIES       8
+#define THREAD_PRIORITY_DEFAULT 3
+// Idle thread is here, so it runs only when nothing else can. Background work may share it.
+#define THREAD_PRIORITY_IDLE    (THREAD_PRIORITIES - 1)
+
 struct mutex;
+struct run_queue;
+struct spinlock;
 
 struct condition_variable {
 	struct mutex* mutex;
@@ -38,6 +49,22 @@ struct thread {
 
 	void* stack;
 	void* stack_pointer;
+	int priority;
+	// Alive, waiting for its turn
+	bool is_queued;
+	// CPU's own, it never sleeps or moves
+	bool is_idle;
+	// Of the CPU it runs or waits on, or ran on the last time
+	struct run_queue* queue;
+	// Off the run lists until woken, cleared by the one who wakes it
+	bool is_sleeping;
+	// Dead and off its CPU, so its stack may be freed
+	bool is_switched_out;
+	// TSC cycles on CPU, and scaled by weight for fair class
+	uint64_t runtime;
+	uint64_t vruntime;
+	// In the tree of fair class when alive
+	struct avl_node scheduler_node;
 	// Thread can be contained it 2 lists. Sheduler's one:
 	struct list_node scheduler_link;
 	// And another one (for condition variable, etc)
@@ -47,25 +74,48 @@ struct thread {
 void cv_init(struct condition_variable* varibale, struct mutex* mutex);
 void cv_finit(struct condition_variable* variable);
 void cv_wait(struct condition_variable* variable);
+// False if not notified in ns nanoseconds (rounded up to ticks)
+bool cv_wait_timeout(struct condition_variable* variable, uint64_t ns);
 void cv_notify(struct condition_variable* variable);
 void cv_notify_all(struct condition_variable* variable);
 
 uint64_t hard_lock();
 void hard_unlock(uint64_t rflags);
+// Spinlock of one structure, with interrupts off so handlers may take it too. Never held across a switch.
+uint64_t hard_spin_lock(struct spinlock* lock);
+void hard_spin_unlock(struct spinlock* lock, uint64_t rflags);
 
 void mutex_init (struct mutex* mutex);
 void mutex_finit(struct mutex* mutex);
 void mutex_lock(struct mutex* mutex);
+// Doesn't wait, false if mutex is locked already
+bool mutex_try_lock(struct mutex* mutex);
 void mutex_unlock(struct mutex* mutex);
 
 struct thread* thread_create(thread_func_t func, void* data, const char* name);
 struct thread* thread_current(void);
 void* thread_join(struct thread* thread);
+// Off the run lists until time is over (rounded up to ticks)
+void thread_sleep(uint64_t ns);
+// New threads have THREAD_PRIORITY_DEFAULT
+void thread_set_priority(struct thread* thread, int priority);
 
 // Assembly:
 void thread_switch(void** old_stack, void* new_stack);
 void thread_run_wrapper(void);
 
+enum scheduler_class_id {
+	SCHEDULER_RR,
+	SCHEDULER_FAIR
+};
+
+// Woken threads are put up to that much virtual runtime (TSC cycles, about 3 ms at 2 GHz) before others
+#define SCHEDULER_SLEEPER_CREDIT (6ull * 1000 * 1000)
+
+// Called before scheduler_init, from cmdline. Round-robin is the default.
+void scheduler_set_class(enum scheduler_class_id id);
+enum scheduler_class_id scheduler_get_class(void);
+
 enum thread_new_state {
 	THREAD_NEW_STATE_ALIVE,
 	THREAD_NEW_STATE_SLEEP,
@@ -73,7 +123,12 @@ enum thread_new_state {
 };
 
 void scheduler_init(void);
+// BSP gives AP its idle thread's stack, then AP starts scheduling on itself
+void scheduler_prepare_cpu(int cpu, void* stack);
+void scheduler_init_cpu(void);
 void schedule(enum thread_new_state state);
+// No thread waits for its turn here (or elsewhere, for idle CPU), so switching is pointless. Others may change that any moment.
+bool scheduler_is_alone(void);
 void yield(void);
 
 static inline void write_rflags(uint64_t rflags) {
@@ -0,0 +1,172 @@
+#include "timer.h"
+#include "kernel_config.h"
+#include "pit.h"
+#include "threads.h"
+#include "spinlock.h"
+
+// Classic cascading wheel. Level L slot holds timers expiring within 2^(BITS * L) ticks window,
+// when lower level wraps around, next slot of upper level is spread over lower levels.
+// Functions are called with the lock released, running one is known so it can be waited for.
+static struct {
+	struct spinlock lock;
+	// Next tick to be processed, everything before it has fired
+	uint64_t now;
+	struct list_node slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	struct timer* volatile running;
+} wheel;
+
+static volatile uint64_t ticks = 0;
+
+void timers_init(void) {
+	spin_init(&wheel.lock);
+	wheel.now = 0;
+	wheel.running = NULL;
+	for (int level = 0; level != TIMER_WHEEL_LEVELS; ++level) {
+		for (int slot = 0; slot != TIMER_WHEEL_SLOTS; ++slot) {
+			list_init(&wheel.slots[level][slot]);
+		}
+	}
+}
+
+uint64_t timer_ticks(void) {
+	return ticks;
+}
+
+uint64_t timer_now_ns(void) {
+	// Through microseconds, so it does not overflow for months
+	return timer_ticks() * (PIT_DIVISOR * 1000000ull) / PIT_FREQUENCY * 1000;
+}
+
+uint64_t timer_ns_to_ticks(uint64_t ns) {
+	uint64_t us = (ns + 999) / 1000;
+	return (us * PIT_FREQUENCY + PIT_DIVISOR * 1000000ull - 1) / (PIT_DIVISOR * 1000000ull);
+}
+
+void timer_init(struct timer* timer, timer_func_t func, void* data) {
+	list_init(&timer->link);
+	timer->func = func;
+	timer->data = data;
+	timer->is_pending = false;
+}
+
+static inline int timer_slot(uint64_t expires, int level) {
+	return (expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+}
+
+// Under the wheel lock
+static void __timer_add(struct timer* timer) {
+	if (timer->expires < wheel.now) {
+		// Late already, fire on the next tick
+		timer->expires = wheel.now;
+	}
+	uint64_t delta = timer->expires - wheel.now;
+	if (delta > TIMER_MAX_TICKS) {
+		timer->expires = wheel.now + TIMER_MAX_TICKS;
+		delta = TIMER_MAX_TICKS;
+	}
+	int level = 0;
+	while (delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1)))) {
+		++level;
+	}
+	list_add_tail(&timer->link, &wheel.slots[level][timer_slot(timer->expires, level)]);
+	timer->is_pending = true;
+}
+
+void timer_add(struct timer* timer, uint64_t ticks) {
+	uint64_t rflags = hard_spin_lock(&wheel.lock);
+	if (timer->is_pending) {
+		list_delete(&timer->link);
+	}
+	timer->expires = wheel.now + (ticks != 0 ? ticks : 1);
+	__timer_add(timer);
+	uint64_t interrupts = timer->expires - wheel.now + 1;
+	hard_spin_unlock(&wheel.lock, rflags);
+	// One-shot PIT may be set to fire later than that
+	pit_timer_added(interrupts);
+}
+
+bool timer_cancel(struct timer* timer) {
+	uint64_t rflags = hard_spin_lock(&wheel.lock);
+	bool was_pending = timer->is_pending;
+	if (was_pending) {
+		list_delete(&timer->link);
+		timer->is_pending = false;
+	}
+	// Fired, but its function may still use it
+	while (wheel.running == timer) {
+		spin_unlock(&wheel.lock);
+		asm volatile ("pause");
+		spin_lock(&wheel.lock);
+	}
+	hard_spin_unlock(&wheel.lock, rflags);
+	return was_pending;
+}
+
+// Timers of a slot go down to lower levels, as they are close now
+static void timer_cascade(int level) {
+	struct list_node* head = &wheel.slots[level][timer_slot(wheel.now, level)];
+	struct list_node moved;
+	list_init(&moved);
+	while (!list_empty(head)) {
+		struct list_node* node = list_first(head);
+		list_delete(node);
+		list_add_tail(node, &moved);
+	}
+	while (!list_empty(&moved)) {
+		struct timer* timer = LIST_ENTRY(list_first(&moved), struct timer, link);
+		list_delete(&timer->link);
+		__timer_add(timer);
+	}
+}
+
+bool timer_tick(uint64_t elapsed) {
+	bool is_fired = false;
+	uint64_t rflags = hard_spin_lock(&wheel.lock);
+	ticks += elapsed;
+	while (wheel.now < ticks) {
+		int slot = timer_slot(wheel.now, 0);
+		for (int level = 1; slot == 0 && level != TIMER_WHEEL_LEVELS; ++level) {
+			timer_cascade(level);
+			slot = timer_slot(wheel.now, level);
+		}
+		struct list_node* head = &wheel.slots[0][timer_slot(wheel.now, 0)];
+		while (!list_empty(head)) {
+			struct timer* timer = LIST_ENTRY(list_first(head), struct timer, link);
+			list_delete(&timer->link);
+			timer->is_pending = false;
+			wheel.running = timer;
+			spin_unlock(&wheel.lock);
+			timer->func(timer);
+			spin_lock(&wheel.lock);
+			wheel.running = NULL;
+			is_fired = true;
+		}
+		++wheel.now;
+	}
+	hard_spin_unlock(&wheel.lock, rflags);
+	return is_fired;
+}
+
+uint64_t timer_next_event(uint64_t limit) {
+	uint64_t rflags = hard_spin_lock(&wheel.lock);
+	uint64_t delta;
+	for (delta = 0; delta != limit; ++delta) {
+		uint64_t tick = wheel.now + delta;
+		if (!list_empty(&wheel.slots[0][timer_slot(tick, 0)])) {
+			break;
+		}
+		// Cascade happens there, and it has to be on time
+		bool is_cascade = false;
+		int slot = timer_slot(tick, 0);
+		for (int level = 1; slot == 0 && level != TIMER_WHEEL_LEVELS; ++level) {
+			slot = timer_slot(tick, level);
+			is_cascade |= !list_empty(&wheel.slots[level][slot]);
+		}
+		if (is_cascade) {
+			break;
+		}
+	}
+	hard_spin_unlock(&wheel.lock, rflags);
+	// Tick N is processed by (N - now + 1)-th interrupt
+	return delta != limit ? delta + 1 : limit;
+}
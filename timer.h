@@ -0,0 +1,46 @@
+#pragma once
+
+#include "list.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Monotonic clock in PIT ticks, and timers on a hierarchical wheel checked on each tick.
+// Timer functions run in PIT interrupt with no lock held, they take what they need but mutexes.
+
+// Levels of wheel, each has 2^TIMER_WHEEL_BITS slots with 2^TIMER_WHEEL_BITS times coarser step than the previous one
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+// Timers further than that are fired earlier, at this distance
+#define TIMER_MAX_TICKS    ((1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+struct timer;
+typedef void (*timer_func_t)(struct timer* timer);
+
+struct timer {
+	struct list_node link;
+	// Tick to fire at
+	uint64_t expires;
+	timer_func_t func;
+	void* data;
+	bool is_pending;
+};
+
+void timers_init(void);
+// Called from PIT interrupt, elapsed ticks since the previous one (more than one in one-shot mode).
+// True if some timer has fired.
+bool timer_tick(uint64_t elapsed);
+// Interrupts needed to reach the next pending timer or cascade, limit if it is not closer
+uint64_t timer_next_event(uint64_t limit);
+
+uint64_t timer_ticks(void);
+uint64_t timer_now_ns(void);
+// Rounded up, so waiting that much is never shorter
+uint64_t timer_ns_to_ticks(uint64_t ns);
+
+void timer_init(struct timer* timer, timer_func_t func, void* data);
+// Fires in that many ticks, at least one. Pending timer is moved.
+void timer_add(struct timer* timer, uint64_t ticks);
+// False if it was not pending (i.e. has fired already). Waits for its function to return,
+// so it must not be called under a lock that function takes.
+bool timer_cancel(struct timer* timer);
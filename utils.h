@@ -17,3 +17,9 @@ static int max(int a, int b) {
 static uint64_t max_u64(uint64_t a, uint64_t b) {
 	return (a > b) ? a : b;
 }
+
+static inline uint64_t rdtsc(void) {
+	uint32_t low, high;
+	asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}